@@ -0,0 +1,313 @@
+/* Benchmark of the server's networking backends: the way the broadcaster
+ * uses them, a message is sent to every connection in one send_batch, once
+ * per interval. The clients run in a child process, so that the server's
+ * side is measured alone: the system calls sending takes, its CPU time and
+ * context switches, and the latencies of the messages from the send to the
+ * client's read, against the system-wide clock. The asio backend makes a
+ * blocking write per send, at least one system call; io_uring counts its
+ * io_uring_enter calls, receives and accepts included.
+ *
+ * Stalled connections never read, to see what a backend does with a client
+ * which doesn't keep up. The asio backend blocks the sender on them, so they
+ * are only taken with io_uring. For every system call, by name, run it under
+ * strace -f -c.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <boost/program_options.hpp>
+
+#include "connection.hpp"
+
+#if __has_include(<linux/io_uring.h>)
+#define BOMBERMAN_HAS_IO_URING
+#include "io-uring-backend.hpp"
+#endif
+
+namespace po = boost::program_options;
+using std::chrono::steady_clock;
+
+struct bench_params {
+  std::string backend;
+  port_t port;
+  size_t connections;
+  size_t stalled;
+  size_t broadcasts;
+  size_t size;
+  std::chrono::microseconds interval;
+};
+
+uint64_t now_ns() {
+  return static_cast<uint64_t>(
+    std::chrono::duration_cast<std::chrono::nanoseconds>(steady_clock::now().time_since_epoch()).count()
+  );
+}
+
+int connect_to(port_t port, bool stalled) {
+  int fd = socket(AF_INET6, SOCK_STREAM, 0);
+  if (fd < 0) { return -1; }
+  if (stalled) {
+    int small = 4096;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &small, sizeof(small));
+  }
+  sockaddr_in6 addr {};
+  addr.sin6_family = AF_INET6;
+  addr.sin6_port = htons(port);
+  addr.sin6_addr = in6addr_loopback;
+  // the server may not be listening yet
+  for (int attempt = 0; attempt < 100; ++attempt) {
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) { return fd; }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+  close(fd);
+  return -1;
+}
+
+// The child: reads the messages, each stamped with its send time
+int run_clients(const bench_params& params) {
+  std::vector<int> stalled;
+  for (size_t i=0; i < params.stalled; ++i) { stalled.push_back(connect_to(params.port, true)); }
+
+  int epoll_fd = epoll_create1(0);
+  std::vector<int> fds;
+  for (size_t i=0; i < params.connections; ++i) {
+    int fd = connect_to(params.port, false);
+    if (fd < 0) {
+      std::cerr << "Unable to connect: " << std::strerror(errno) << std::endl;
+      return 1;
+    }
+    epoll_event event {};
+    event.events = EPOLLIN;
+    event.data.u64 = fds.size();
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    fds.push_back(fd);
+  }
+
+  // the part of the current message each connection has read
+  std::vector<std::vector<unsigned char>> messages (fds.size(), std::vector<unsigned char>(params.size));
+  std::vector<size_t> filled (fds.size());
+  std::vector<uint64_t> latencies;
+  latencies.reserve(params.connections * params.broadcasts);
+  std::vector<unsigned char> chunk (1 << 16);
+  std::vector<epoll_event> events (fds.size());
+
+  // done when every message is in, or nothing came for a while
+  while (latencies.size() < params.connections * params.broadcasts) {
+    int ready = epoll_wait(epoll_fd, events.data(), static_cast<int>(events.size()), 5000);
+    if (ready <= 0) { break; }
+    for (int e=0; e < ready; ++e) {
+      size_t i = events[static_cast<size_t>(e)].data.u64;
+      ssize_t received = read(fds[i], chunk.data(), chunk.size());
+      if (received <= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fds[i], nullptr);
+        continue;
+      }
+      uint64_t arrived = now_ns();
+      for (size_t at = 0; at < static_cast<size_t>(received);) {
+        size_t take = std::min(params.size - filled[i], static_cast<size_t>(received) - at);
+        std::memcpy(messages[i].data() + filled[i], chunk.data() + at, take);
+        filled[i] += take;
+        at += take;
+        if (filled[i] == params.size) {
+          uint64_t sent;
+          std::memcpy(&sent, messages[i].data(), sizeof(sent));
+          latencies.push_back(arrived - sent);
+          filled[i] = 0;
+        }
+      }
+    }
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&latencies] (double share) {
+    if (latencies.empty()) { return uint64_t {0}; }
+    return latencies[std::min(latencies.size() - 1, static_cast<size_t>(share * static_cast<double>(latencies.size())))];
+  };
+  std::cout << "Messages received: " << latencies.size()
+            << " of " << params.connections * params.broadcasts << '\n'
+            << "Latency (us): p50 " << percentile(0.5) / 1000
+            << ", p99 " << percentile(0.99) / 1000
+            << ", p99.9 " << percentile(0.999) / 1000
+            << ", max " << (latencies.empty() ? 0 : latencies.back() / 1000) << std::endl;
+  for (int fd : fds) { close(fd); }
+  for (int fd : stalled) { close(fd); }
+  return 0;
+}
+
+struct server_usage {
+  uint64_t sends = 0;
+  uint64_t enters = 0;
+  rusage usage {};
+
+  static server_usage now(uint64_t sends) {
+    server_usage result;
+    result.sends = sends;
+#ifdef BOMBERMAN_HAS_IO_URING
+    result.enters = uring::enters.load();
+#endif
+    getrusage(RUSAGE_SELF, &result.usage);
+    return result;
+  }
+
+  uint64_t syscalls(const std::string& backend) const {
+    return backend == "asio" ? sends : enters;
+  }
+};
+
+double seconds(const timeval& t) {
+  return static_cast<double>(t.tv_sec) + static_cast<double>(t.tv_usec) / 1e6;
+}
+
+int run_server(const bench_params& params, pid_t clients) {
+  std::unique_ptr<network_backend> backend;
+  if (params.backend == "asio") {
+    backend = std::make_unique<asio_backend>();
+#ifdef BOMBERMAN_HAS_IO_URING
+  } else {
+    backend = std::make_unique<io_uring_backend>();
+#endif
+  }
+
+  std::mutex mutex_conns;
+  std::condition_variable cond_conns;
+  std::vector<std::shared_ptr<connection>> conns;
+  // serves as long as the process lives
+  std::thread {[&] {
+    backend->serve(params.port, [&] (std::shared_ptr<connection> conn) {
+      std::scoped_lock lock {mutex_conns};
+      conns.push_back(std::move(conn));
+      cond_conns.notify_one();
+    });
+  }}.detach();
+
+  size_t expected = params.connections + params.stalled;
+  {
+    std::unique_lock lock {mutex_conns};
+    if (!cond_conns.wait_for(lock, std::chrono::seconds(30), [&] { return conns.size() == expected; })) {
+      std::cerr << "Only " << conns.size() << " of " << expected << " connections came" << std::endl;
+      return 1;
+    }
+  }
+
+  std::vector<unsigned char> message (params.size);
+  std::vector<bool> dead (conns.size());
+  size_t cut_off = 0;
+  uint64_t sends = 0;
+  server_usage before = server_usage::now(sends);
+  steady_clock::time_point next = steady_clock::now();
+  for (size_t b=0; b < params.broadcasts; ++b) {
+    uint64_t sent = now_ns();
+    std::memcpy(message.data(), &sent, sizeof(sent));
+    {
+      send_batch batch {*backend};
+      for (size_t i=0; i < conns.size(); ++i) {
+        if (dead[i]) { continue; }
+        try {
+          conns[i]->send(message);
+          ++sends;
+        } catch (const boost::system::system_error& e) {
+          dead[i] = true;
+          ++cut_off;
+        }
+      }
+    }
+    next += params.interval;
+    std::this_thread::sleep_until(next);
+  }
+  server_usage after = server_usage::now(sends);
+
+  int status = 0;
+  waitpid(clients, &status, 0);
+  std::cout << "Backend: " << params.backend
+            << ", connections: " << params.connections
+            << ", stalled: " << params.stalled << '\n'
+            << "Sends: " << sends
+            << ", system calls: " << after.syscalls(params.backend) - before.syscalls(params.backend) << '\n'
+            << "Server CPU (s): user " << seconds(after.usage.ru_utime) - seconds(before.usage.ru_utime)
+            << ", system " << seconds(after.usage.ru_stime) - seconds(before.usage.ru_stime) << '\n'
+            << "Server context switches: voluntary " << after.usage.ru_nvcsw - before.usage.ru_nvcsw
+            << ", involuntary " << after.usage.ru_nivcsw - before.usage.ru_nivcsw << '\n'
+            << "Connections cut off: " << cut_off << std::endl;
+  // the backend's threads never stop
+  std::_Exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
+
+int main(int argc, char* argv[]) {
+  po::options_description desc("Options");
+  desc.add_options()
+    ("help,h", "display help message")
+    ("backend", po::value<std::string>()->default_value("asio"), "asio or io_uring")
+    ("port,p", po::value<port_t>()->default_value(20240), "port to serve on")
+    ("connections,c", po::value<size_t>()->default_value(500), "connections which read")
+    ("stalled", po::value<size_t>()->default_value(0), "connections which never read (io_uring only)")
+    ("broadcasts,b", po::value<size_t>()->default_value(1000), "messages sent to every connection")
+    ("size,s", po::value<size_t>()->default_value(256), "bytes per message, at least 8")
+    ("interval,i", po::value<uint32_t>()->default_value(1000), "microseconds between broadcasts");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+  } catch (const po::error& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  if (vm.count("help")) {
+    std::cout << desc << std::endl;
+    return 0;
+  }
+
+  bench_params params {
+    .backend = vm["backend"].as<std::string>(),
+    .port = vm["port"].as<port_t>(),
+    .connections = vm["connections"].as<size_t>(),
+    .stalled = vm["stalled"].as<size_t>(),
+    .broadcasts = vm["broadcasts"].as<size_t>(),
+    .size = std::max(vm["size"].as<size_t>(), sizeof(uint64_t)),
+    .interval = std::chrono::microseconds(vm["interval"].as<uint32_t>())
+  };
+#ifdef BOMBERMAN_HAS_IO_URING
+  bool known = params.backend == "asio" || params.backend == "io_uring";
+#else
+  bool known = params.backend == "asio";
+#endif
+  if (!known) {
+    std::cerr << "Unknown backend: " << params.backend << std::endl;
+    return 1;
+  }
+  if (params.backend == "asio" && params.stalled > 0) {
+    std::cerr << "Stalled connections block the asio backend" << std::endl;
+    return 1;
+  }
+
+  // both ends of every connection are in this benchmark
+  rlimit files;
+  getrlimit(RLIMIT_NOFILE, &files);
+  files.rlim_cur = files.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &files);
+
+  // before any threads are started
+  pid_t clients = fork();
+  if (clients < 0) {
+    std::cerr << "Unable to fork: " << std::strerror(errno) << std::endl;
+    return 1;
+  }
+  if (clients == 0) { return run_clients(params); }
+  return run_server(params, clients);
+}
@@ -0,0 +1,117 @@
+/* Benchmark of the bulk (de)serialization of arrays of fixed-layout elements
+ * against doing it element by element, as it used to be done, on a large
+ * std::vector<Position>. Both ways must give the same bytes and values.
+ */
+
+#include <algorithm> // std::ranges::equal
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "messages.hpp"
+#include "streamable-buffer.hpp"
+#include "serialization.hpp"
+
+namespace po = boost::program_options;
+using std::chrono::steady_clock;
+
+void encode_each(streamable_buffer& stream, const std::vector<Position>& positions) {
+  stream << static_cast<uint32_t>(positions.size());
+  for (const Position& pos : positions) { stream << pos; }
+}
+
+void decode_each(streamable_buffer& stream, std::vector<Position>& positions) {
+  uint32_t size;
+  stream >> size;
+  positions.clear();
+  positions.reserve(size);
+  for (uint32_t i=0; i < size; ++i) {
+    Position pos;
+    stream >> pos;
+    positions.push_back(pos);
+  }
+}
+
+// The fastest of the repetitions, in nanoseconds per element
+template <typename F>
+double time_per_element(size_t elements, size_t repetitions, F f) {
+  double best = 0;
+  for (size_t r=0; r < repetitions; ++r) {
+    steady_clock::time_point start = steady_clock::now();
+    f();
+    std::chrono::duration<double, std::nano> took = steady_clock::now() - start;
+    double per_element = took.count() / static_cast<double>(elements);
+    if (r == 0 || per_element < best) { best = per_element; }
+  }
+  return best;
+}
+
+int main(int argc, char* argv[]) {
+  po::options_description desc("Options");
+  desc.add_options()
+    ("help,h", "display help message")
+    ("elements,n", po::value<size_t>()->default_value(1 << 20), "positions in the array")
+    ("repetitions,r", po::value<size_t>()->default_value(20), "runs of every variant, the fastest counts");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+  } catch (const po::error& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  if (vm.count("help")) {
+    std::cout << desc << std::endl;
+    return 0;
+  }
+  size_t elements = vm["elements"].as<size_t>();
+  size_t repetitions = vm["repetitions"].as<size_t>();
+
+  std::vector<Position> positions (elements);
+  for (size_t i=0; i < elements; ++i) {
+    positions[i] = Position {.x = static_cast<pos_t>(i * 7), .y = static_cast<pos_t>(i * 13 + 1)};
+  }
+
+  streamable_buffer each;
+  streamable_buffer bulk;
+  double encode_each_ns = time_per_element(elements, repetitions, [&] {
+    each.clear();
+    encode_each(each, positions);
+  });
+  double encode_bulk_ns = time_per_element(elements, repetitions, [&] {
+    bulk.clear();
+    bulk << positions;
+  });
+  std::vector<unsigned char> encoded (bulk.data().begin(), bulk.data().end());
+  if (!std::ranges::equal(each.data(), bulk.data())) {
+    std::cerr << "The encodings differ" << std::endl;
+    return 1;
+  }
+
+  std::vector<Position> decoded_each;
+  std::vector<Position> decoded_bulk;
+  streamable_buffer stream;
+  double decode_each_ns = time_per_element(elements, repetitions, [&] {
+    stream.assign_view(encoded);
+    decode_each(stream, decoded_each);
+  });
+  double decode_bulk_ns = time_per_element(elements, repetitions, [&] {
+    stream.assign_view(encoded);
+    stream >> decoded_bulk;
+  });
+  if (decoded_each != positions || decoded_bulk != positions) {
+    std::cerr << "The decoded positions differ" << std::endl;
+    return 1;
+  }
+
+  std::cout << "Positions: " << elements << " (ns per element, fastest of " << repetitions << ")\n"
+            << "Encode: element by element " << encode_each_ns << ", bulk " << encode_bulk_ns
+            << " (" << encode_each_ns / encode_bulk_ns << "x)\n"
+            << "Decode: element by element " << decode_each_ns << ", bulk " << decode_bulk_ns
+            << " (" << decode_each_ns / decode_bulk_ns << "x)" << std::endl;
+  return 0;
+}
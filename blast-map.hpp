@@ -0,0 +1,154 @@
+/* Index of the blocks on a board, answering how far an explosion arm reaches
+ * without walking its cells. Every row and column keeps the ordered
+ * coordinates of its blocks, so the nearest block along an arm is a single
+ * ordered lookup, and placing or destroying a block only touches its own row
+ * and column. Sparse, so it works for boards of any size.
+ */
+
+#ifndef BOMBERMAN_BLAST_MAP_HPP
+#define BOMBERMAN_BLAST_MAP_HPP
+
+#include <algorithm> // std::min
+#include <array>
+#include <set>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+#include "messages.hpp"
+
+class blast_map {
+  pos_t size_x = 0;
+  pos_t size_y = 0;
+
+  // y -> x of the blocks in that row, x -> y of the blocks in that column
+  std::unordered_map<pos_t, std::set<pos_t>> rows;
+  std::unordered_map<pos_t, std::set<pos_t>> columns;
+
+  // Distance from `from` to the end of the arm going up (`forward`) or down
+  // the given line: to the first block, if any, but at most `radius` cells
+  // and not past the board's edge at `last`.
+  static pos_t arm(const std::set<pos_t>* line, pos_t from, bool forward,
+                   explosion_radius_t radius, pos_t last) {
+    pos_t limit = forward
+      ? static_cast<pos_t>(std::min<int>(last - from, radius))
+      : static_cast<pos_t>(std::min<int>(from, radius));
+    if (line == nullptr) { return limit; }
+
+    if (forward) {
+      auto it = line->upper_bound(from);
+      if (it != line->end()) { limit = std::min<pos_t>(limit, static_cast<pos_t>(*it - from)); }
+    } else {
+      auto it = line->lower_bound(from);
+      if (it != line->begin()) { limit = std::min<pos_t>(limit, static_cast<pos_t>(from - *std::prev(it))); }
+    }
+    return limit;
+  }
+
+  static const std::set<pos_t>* find(const std::unordered_map<pos_t, std::set<pos_t>>& lines, pos_t key) {
+    auto it = lines.find(key);
+    return it == lines.end() ? nullptr : &it->second;
+  }
+
+public:
+  blast_map() = default;
+
+  blast_map(pos_t size_x, pos_t size_y) : size_x(size_x), size_y(size_y) {}
+
+  bool contains(const Position& pos) const {
+    const std::set<pos_t>* row = find(rows, pos.y);
+    return row != nullptr && row->contains(pos.x);
+  }
+
+  // Returns false if there already was a block there
+  bool place(const Position& pos) {
+    if (!rows[pos.y].insert(pos.x).second) { return false; }
+    columns[pos.x].insert(pos.y);
+    return true;
+  }
+
+  // Returns false if there was no block there
+  bool destroy(const Position& pos) {
+    auto row = rows.find(pos.y);
+    if (row == rows.end() || row->second.erase(pos.x) == 0) { return false; }
+    if (row->second.empty()) { rows.erase(row); }
+
+    auto column = columns.find(pos.x);
+    column->second.erase(pos.y);
+    if (column->second.empty()) { columns.erase(column); }
+    return true;
+  }
+
+  void clear() {
+    rows.clear();
+    columns.clear();
+  }
+
+  // How many cells past `center` the arm going in the given direction
+  // covers, the blocking cell included. Directions are the ones of
+  // ClientMessageMove: 0 up (y + 1), 1 right, 2 down, 3 left.
+  pos_t reach(const Position& center, direction_t direction, explosion_radius_t radius) const {
+    if (contains(center)) { return 0; }
+    switch (direction) {
+      case 0: return arm(find(columns, center.x), center.y, true, radius, static_cast<pos_t>(size_y - 1));
+      case 1: return arm(find(rows, center.y), center.x, true, radius, static_cast<pos_t>(size_x - 1));
+      case 2: return arm(find(columns, center.x), center.y, false, radius, static_cast<pos_t>(size_y - 1));
+      default: return arm(find(rows, center.y), center.x, false, radius, static_cast<pos_t>(size_x - 1));
+    }
+  }
+
+  // Append the cells covered by explosions of bombs at the given positions,
+  // all resolved against the same board: blocks destroyed by one of them
+  // don't open the way for the others within the turn.
+  void explode(std::span<const Position> centers, explosion_radius_t radius,
+               std::vector<Position>& cells) const {
+    constexpr std::array<std::pair<int, int>, 4> steps {{ {0, 1}, {1, 0}, {0, -1}, {-1, 0} }};
+
+    for (const Position& center : centers) {
+      cells.push_back(center);
+      for (direction_t direction = 0; direction < steps.size(); ++direction) {
+        auto [dx, dy] = steps[direction];
+        pos_t length = reach(center, direction, radius);
+        for (int t = 1; t <= length; ++t) {
+          cells.push_back(Position {
+            .x = static_cast<pos_t>(center.x + dx * t),
+            .y = static_cast<pos_t>(center.y + dy * t)
+          });
+        }
+      }
+    }
+  }
+};
+
+// The changes to the board gathered from the events of a turn, resolved
+// together at its end in the order the server makes them: the bombs explode
+// against the board as it was before the turn, the blocks they hit go, and
+// only then come the blocks placed by the robots within the turn.
+struct board_changes {
+  std::vector<Position> exploded_bombs;
+  std::set<Position> blocks_destroyed;
+  std::vector<Position> blocks_placed;
+
+  // Appends the cells of the explosions, and calls `destroyed` and `placed`
+  // with every block which actually went or came
+  template <typename Destroyed, typename Placed>
+  void resolve(blast_map& blast, explosion_radius_t radius, std::vector<Position>& cells,
+               Destroyed destroyed, Placed placed) {
+    blast.explode(exploded_bombs, radius, cells);
+    for (const Position& pos : blocks_destroyed) {
+      if (blast.destroy(pos)) { destroyed(pos); }
+    }
+    for (const Position& pos : blocks_placed) {
+      if (blast.place(pos)) { placed(pos); }
+    }
+    clear();
+  }
+
+  void clear() {
+    exploded_bombs.clear();
+    blocks_destroyed.clear();
+    blocks_placed.clear();
+  }
+};
+
+#endif // BOMBERMAN_BLAST_MAP_HPP
@@ -0,0 +1,114 @@
+/* Generation of the initial board: spawn cells of the players and the initial
+ * blocks, all of them distinct and deterministic for a given random engine
+ * state. Cells are sampled without replacement, by a partial Fisher-Yates
+ * shuffle of all the cells when the board is small enough to enumerate, or
+ * by Floyd's algorithm over a hash set of the picked cells, then shuffled,
+ * when it isn't (boards go up to 65535x65535, while at most 65535 + 255
+ * cells are picked).
+ */
+
+#ifndef BOMBERMAN_BOARD_GENERATOR_HPP
+#define BOMBERMAN_BOARD_GENERATOR_HPP
+
+#include <algorithm> // std::sort, std::min, std::swap
+#include <cstdint>
+#include <numeric> // std::iota
+#include <unordered_set>
+#include <vector>
+
+#include "messages.hpp"
+
+struct board_t {
+  // one per player, in the order of player ids
+  std::vector<Position> spawns;
+  // sorted, so that consecutive blocks delta-code into few bytes
+  std::vector<Position> blocks;
+};
+
+namespace board_generator {
+  // boards with at most that many cells are shuffled densely
+  constexpr uint64_t dense_limit = 1 << 20;
+
+  // Uniform enough number in [0, n) for n up to 2^32, made of two draws
+  // since engines such as std::minstd_rand only give 31 random bits
+  template <typename Random>
+  uint64_t draw(Random& random, uint64_t n) {
+    uint64_t high = static_cast<uint64_t>(random());
+    uint64_t low = static_cast<uint64_t>(random());
+    return ((high << 31) ^ low) % n;
+  }
+
+  template <typename Random>
+  std::vector<uint64_t> sample_dense(Random& random, uint64_t cells, uint64_t k) {
+    std::vector<uint32_t> order (cells);
+    std::iota(order.begin(), order.end(), 0);
+    std::vector<uint64_t> picked;
+    picked.reserve(k);
+    for (uint64_t i=0; i < k; ++i) {
+      uint64_t j = i + draw(random, cells - i);
+      std::swap(order[i], order[j]);
+      picked.push_back(order[i]);
+    }
+    return picked;
+  }
+
+  template <typename Random>
+  std::vector<uint64_t> sample_sparse(Random& random, uint64_t cells, uint64_t k) {
+    std::unordered_set<uint64_t> seen;
+    seen.reserve(k);
+    std::vector<uint64_t> picked;
+    picked.reserve(k);
+    for (uint64_t j = cells - k; j < cells; ++j) {
+      uint64_t t = draw(random, j + 1);
+      uint64_t cell = seen.insert(t).second ? t : j;
+      if (cell == j) { seen.insert(j); }
+      picked.push_back(cell);
+    }
+    // Floyd's set is uniform but its order isn't (late cells come last more
+    // often), while the first ones picked become the spawns
+    for (uint64_t i = k; i > 1; --i) {
+      std::swap(picked[i - 1], picked[draw(random, i)]);
+    }
+    return picked;
+  }
+}
+
+// If the board has fewer cells than requested, blocks are dropped first; if
+// it can't even fit the players, some of them share spawn cells.
+template <typename Random>
+board_t generate_board(
+  Random& random,
+  pos_t size_x,
+  pos_t size_y,
+  size_t players,
+  size_t blocks
+) {
+  uint64_t cells = static_cast<uint64_t>(size_x) * size_y;
+  uint64_t k = std::min<uint64_t>(players + blocks, cells);
+  std::vector<uint64_t> picked = cells <= board_generator::dense_limit
+    ? board_generator::sample_dense(random, cells, k)
+    : board_generator::sample_sparse(random, cells, k);
+
+  auto position = [size_x] (uint64_t cell) {
+    return Position {
+      .x = static_cast<pos_t>(cell % size_x),
+      .y = static_cast<pos_t>(cell / size_x)
+    };
+  };
+
+  board_t board;
+  board.spawns.reserve(players);
+  for (size_t i=0; i < players && !picked.empty(); ++i) {
+    board.spawns.push_back(position(picked[i % std::min<uint64_t>(picked.size(), players)]));
+  }
+  if (k > players) {
+    board.blocks.reserve(k - players);
+    for (uint64_t i = players; i < k; ++i) {
+      board.blocks.push_back(position(picked[i]));
+    }
+  }
+  std::sort(board.blocks.begin(), board.blocks.end());
+  return board;
+}
+
+#endif // BOMBERMAN_BOARD_GENERATOR_HPP
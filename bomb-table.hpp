@@ -0,0 +1,126 @@
+/* Bombs alive on the board, keyed by their ids. They are kept in a slot map:
+ * a dense vector of entries plus an id -> slot index, where removal moves the
+ * last entry into the freed slot. Every bomb is also scheduled on a wheel of
+ * turn buckets by the turn its timer runs out in. Timers are never counted
+ * down: the time left is derived from the current turn when it is needed,
+ * so the per-turn cost depends on the events, not on the bombs alive.
+ */
+
+#ifndef BOMBERMAN_BOMB_TABLE_HPP
+#define BOMBERMAN_BOMB_TABLE_HPP
+
+#include <algorithm> // std::max, std::min
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "messages.hpp"
+
+class bomb_table {
+  struct entry {
+    bomb_id_t id;
+    Position position;
+    // the turn in which the bomb's timer reaches 0
+    uint32_t deadline;
+  };
+
+  std::vector<entry> slots;
+  std::unordered_map<bomb_id_t, size_t> index;
+
+  // Bucket deadline % size holds the ids of bombs due in that turn. While the
+  // turns come one by one, the live deadlines span bomb_timer + 2 consecutive
+  // turns (the overdue ones included), so a bucket holds a single deadline;
+  // after a jump it may also hold bombs due a lap later, which stay. Removed
+  // bombs are left in their bucket and dropped when it comes around.
+  std::vector<std::vector<bomb_id_t>> wheel;
+  bomb_timer_t timer = 0;
+  // the bombs due before it are expired already
+  uint32_t expired_until = 0;
+
+public:
+  bomb_table() : wheel(2) {}
+
+  explicit bomb_table(bomb_timer_t timer) : wheel(timer + 2u), timer(timer) {}
+
+  size_t size() const { return slots.size(); }
+
+  // Returns false if there already is such a bomb
+  bool place(bomb_id_t id, const Position& position, turn_t turn) {
+    if (index.contains(id)) { return false; }
+    uint32_t deadline = static_cast<uint32_t>(turn) + timer;
+    index[id] = slots.size();
+    slots.push_back(entry {.id = id, .position = position, .deadline = deadline});
+    wheel[deadline % wheel.size()].push_back(id);
+    return true;
+  }
+
+  std::optional<Position> position(bomb_id_t id) const {
+    auto it = index.find(id);
+    if (it == index.end()) { return std::nullopt; }
+    return slots[it->second].position;
+  }
+
+  // Returns false if there is no such bomb
+  bool remove(bomb_id_t id) {
+    auto it = index.find(id);
+    if (it == index.end()) { return false; }
+    size_t slot = it->second;
+    index.erase(it);
+    if (slot != slots.size() - 1) {
+      slots[slot] = slots.back();
+      index[slots[slot].id] = slot;
+    }
+    slots.pop_back();
+    return true;
+  }
+
+  // Drop the bombs which were due before the given turn but whose explosion
+  // was never reported, calling expired(id, position) on each. Turn by turn
+  // only one bucket of the wheel is visited; if turns were skipped, the
+  // buckets of the skipped ones too, each at most once.
+  template <typename Expired>
+  void expire(turn_t turn, Expired expired) {
+    uint32_t until = turn;
+    if (until <= expired_until) { return; }
+    uint32_t lap = static_cast<uint32_t>(wheel.size());
+    uint32_t first = std::max(expired_until, until - std::min(until, lap));
+    for (uint32_t deadline = first; deadline < until; ++deadline) {
+      uint32_t b = deadline % lap;
+      std::erase_if(wheel[b], [&] (bomb_id_t id) {
+        auto it = index.find(id);
+        // removed, or placed again and scheduled elsewhere
+        if (it == index.end() || slots[it->second].deadline % lap != b) { return true; }
+        if (slots[it->second].deadline >= until) { return false; }
+        expired(id, slots[it->second].position);
+        remove(id);
+        return true;
+      });
+    }
+    expired_until = until;
+  }
+
+  void expire(turn_t turn) {
+    expire(turn, [] (bomb_id_t, const Position&) {});
+  }
+
+  // The bombs as drawn in the given turn, with the turns left until they go off
+  void draw(turn_t turn, std::vector<Bomb>& bombs) const {
+    bombs.clear();
+    bombs.reserve(slots.size());
+    for (const entry& bomb : slots) {
+      bombs.push_back(Bomb {
+        .position = bomb.position,
+        .timer = static_cast<bomb_timer_t>(bomb.deadline > turn ? bomb.deadline - turn : 0)
+      });
+    }
+  }
+
+  void clear() {
+    slots.clear();
+    index.clear();
+    for (std::vector<bomb_id_t>& bucket : wheel) { bucket.clear(); }
+    expired_until = 0;
+  }
+};
+
+#endif // BOMBERMAN_BOMB_TABLE_HPP
@@ -0,0 +1,62 @@
+/* Byte order conversion of whole runs of equally wide integers, used by the
+ * bulk (de)serialization of arrays in serialization.hpp. Lanes are swapped
+ * 16 bytes at a time with SSSE3 when the compiler targets it, with SSE2 for
+ * 16-bit lanes otherwise, and one by one for the tail.
+ */
+
+#ifndef BOMBERMAN_BYTE_ORDER_HPP
+#define BOMBERMAN_BYTE_ORDER_HPP
+
+#include <algorithm> // std::reverse
+#include <array>
+#include <bit> // std::endian
+#include <cstddef> // size_t
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Convert `lanes` integers of `Lane` bytes each, stored contiguously at
+// `data`, between native and big-endian order. It is its own inverse.
+template <size_t Lane>
+void big_endian_lanes(unsigned char* data, size_t lanes) {
+  static_assert(Lane > 0 && 16 % Lane == 0, "lane must divide a SIMD register");
+
+  if constexpr (Lane == 1 || std::endian::native == std::endian::big) {
+    return;
+  } else {
+    const size_t bytes = lanes * Lane;
+    size_t i = 0;
+
+#if defined(__SSSE3__)
+    constexpr auto shuffle = [] {
+      std::array<char, 16> order {};
+      for (size_t j=0; j < order.size(); ++j) {
+        order[j] = static_cast<char>(j / Lane * Lane + (Lane - 1 - j % Lane));
+      }
+      return order;
+    }();
+    const __m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i*>(shuffle.data()));
+    for (; i + 16 <= bytes; i += 16) {
+      __m128i* chunk = reinterpret_cast<__m128i*>(data + i);
+      _mm_storeu_si128(chunk, _mm_shuffle_epi8(_mm_loadu_si128(chunk), mask));
+    }
+#elif defined(__SSE2__)
+    if constexpr (Lane == 2) {
+      for (; i + 16 <= bytes; i += 16) {
+        __m128i* chunk = reinterpret_cast<__m128i*>(data + i);
+        __m128i v = _mm_loadu_si128(chunk);
+        _mm_storeu_si128(chunk, _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+      }
+    }
+#endif
+
+    for (; i < bytes; i += Lane) {
+      std::reverse(data + i, data + i + Lane);
+    }
+  }
+}
+
+#endif // BOMBERMAN_BYTE_ORDER_HPP
@@ -3,6 +3,7 @@
 
 #include <charconv> // std::from_chars
 #include <concepts> // std::unsigned_integral
+#include <span>
 #include <stdexcept> // std::runtime_error
 #include <system_error> // std::errc
 
@@ -10,10 +11,10 @@
 
 #include "streamable-buffer.hpp"
 
-// The maximal size of data in a UDP packet is the maximal size of an UDP
-// packet (1 << 16 bytes) decreased by the size of an IP header (20 bytes)
-// and an UDP header (8 bytes).
-constexpr size_t MAX_UDP_MESSAGE_SIZE = (1 << 16) - 20 - 8;
+// The maximal size of data in a UDP packet is the maximal size of an IP
+// packet ((1 << 16) - 1 bytes) decreased by the size of an IP header
+// (20 bytes) and an UDP header (8 bytes).
+constexpr size_t MAX_UDP_MESSAGE_SIZE = (1 << 16) - 1 - 20 - 8;
 
 using port_t = uint16_t;
 
@@ -41,18 +42,18 @@ T parse_uint(const char* first, const char* last) {
 
 // to nie powinno byc w cpp - to powinno byc jako template z tcp/udp
 
+void send(std::span<const unsigned char> data, boost::asio::ip::tcp::socket& sock) {
+  boost::asio::write(sock, boost::asio::buffer(data.data(), data.size()));
+}
+
 void send(streamable_buffer& stream, boost::asio::ip::tcp::socket& sock) {
-  auto buffer = stream.get_buffer();
-  const std::vector<unsigned char>& data { buffer.begin(), buffer.end() };
-  sock.send(boost::asio::buffer(data));
+  send(stream.data(), sock);
   stream.clear();
 }
 
-std::vector<uint8_t> read(boost::asio::ip::tcp::socket& sock, size_t n) {
-  std::vector<uint8_t> buffer (n);
-  size_t rec = boost::asio::read(sock, boost::asio::buffer(buffer));
-  assert(rec == n);
-  return buffer;
+void read(boost::asio::ip::tcp::socket& sock, std::span<unsigned char> out) {
+  size_t rec = boost::asio::read(sock, boost::asio::buffer(out.data(), out.size()));
+  assert(rec == out.size());
 }
 
 #endif // BOMBERMAN_COMMON_HPP
@@ -0,0 +1,160 @@
+/* The server's view of a client connection, independent of the networking
+ * backend serving it. Sessions read from and write to a connection as they
+ * used to on a blocking socket: read() returns once `out` is filled, and both
+ * throw boost::system::system_error when the connection breaks. A backend
+ * accepts the connections and hands each one over to the server.
+ */
+
+#ifndef BOMBERMAN_CONNECTION_HPP
+#define BOMBERMAN_CONNECTION_HPP
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "common.hpp"
+#include "streamable-buffer.hpp"
+
+class connection {
+public:
+  virtual ~connection() = default;
+
+  virtual void send(std::span<const unsigned char> data) = 0;
+  virtual void read(std::span<unsigned char> out) = 0;
+  // Stops both directions; a session blocked in read() gets an error
+  virtual void shutdown() = 0;
+  virtual boost::asio::ip::tcp::endpoint remote_endpoint() const = 0;
+};
+
+void send(streamable_buffer& stream, connection& conn) {
+  conn.send(stream.data());
+  stream.clear();
+}
+
+class network_backend {
+public:
+  using accept_handler = std::function<void(std::shared_ptr<connection>)>;
+
+  virtual ~network_backend() = default;
+
+  // Accepts connections on the port forever, passing them to the handler
+  virtual void serve(port_t port, accept_handler on_accept) = 0;
+
+  // Sends made while a batch is open may be held back until the outermost
+  // batch closes, and then handed to the kernel together
+  virtual void begin_batch() {}
+  virtual void end_batch() {}
+};
+
+class send_batch {
+  network_backend& backend;
+
+public:
+  explicit send_batch(network_backend& backend) : backend(backend) {
+    backend.begin_batch();
+  }
+  ~send_batch() { backend.end_batch(); }
+
+  send_batch(const send_batch&) = delete;
+  send_batch& operator=(const send_batch&) = delete;
+};
+
+// Blocking socket of a per-connection thread; owns the socket, so that a
+// connection takes a single allocation
+class asio_connection : public connection {
+  boost::asio::ip::tcp::socket sock;
+  const boost::asio::ip::tcp::endpoint endpoint;
+
+public:
+  explicit asio_connection(boost::asio::ip::tcp::socket&& sock)
+    : sock(std::move(sock)), endpoint(this->sock.remote_endpoint()) {}
+
+  void send(std::span<const unsigned char> data) override { ::send(data, sock); }
+
+  void read(std::span<unsigned char> out) override { ::read(sock, out); }
+
+  void shutdown() override {
+    try {
+      sock.shutdown(boost::asio::ip::tcp::socket::shutdown_both);
+    } catch (const boost::system::system_error& e) {}
+  }
+
+  boost::asio::ip::tcp::endpoint remote_endpoint() const override { return endpoint; }
+};
+
+// Accepts on one or more listening sockets, each with a thread of its own.
+// More than one needs SO_REUSEPORT: the kernel then spreads the incoming
+// connections over the sockets, so that a burst of them is accepted by all
+// the threads at once.
+class asio_backend : public network_backend {
+  boost::asio::io_service io_service;
+  const size_t acceptors;
+
+  void accept_loop(boost::asio::ip::tcp::acceptor& a, const accept_handler& on_accept) {
+    using boost::asio::ip::tcp;
+    while (true) {
+      tcp::socket sock {io_service};
+      try {
+        a.accept(sock);
+      } catch (const boost::system::system_error& e) {
+        // e.g. the peer gave up before it was accepted, or a storm of them
+        // took all the descriptors, which the sessions give back as they end
+        std::cerr << "Error: unable to accept: " << e.what() << std::endl;
+        if (e.code() == boost::asio::error::no_descriptors
+            || e.code() == boost::system::errc::too_many_files_open_in_system) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        continue;
+      }
+      try {
+        sock.set_option(tcp::no_delay(true));
+        on_accept(std::make_shared<asio_connection>(std::move(sock)));
+      } catch (const boost::system::system_error& e) {
+        std::cerr << "Error: unable to connect client" << std::endl;
+      }
+    }
+  }
+
+public:
+  static bool reuse_port_supported() {
+#ifdef SO_REUSEPORT
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  explicit asio_backend(size_t acceptors = 1) : acceptors(acceptors) {}
+
+  void serve(port_t port, accept_handler on_accept) override {
+    using boost::asio::ip::tcp;
+    std::vector<std::unique_ptr<tcp::acceptor>> listeners;
+    for (size_t i=0; i < acceptors; ++i) {
+      auto a = std::make_unique<tcp::acceptor>(io_service);
+      a->open(tcp::v6());
+      a->set_option(tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+      if (acceptors > 1) {
+        a->set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+      }
+#endif
+      a->bind(tcp::endpoint(tcp::v6(), port));
+      a->listen(tcp::socket::max_listen_connections);
+      listeners.push_back(std::move(a));
+    }
+
+    // the acceptors never stop, so neither do their threads
+    for (size_t i=1; i < listeners.size(); ++i) {
+      std::thread {[this, &a = *listeners[i], &on_accept] { accept_loop(a, on_accept); }}.detach();
+    }
+    accept_loop(*listeners[0], on_accept);
+  }
+};
+
+#endif // BOMBERMAN_CONNECTION_HPP
@@ -15,6 +15,7 @@
 
 #include "streamable-buffer.hpp"
 #include "messages.hpp"
+#include "player-table.hpp"
 
 template<typename u, typename v>
 std::ostream& operator<< (std::ostream& out, const std::pair<u, v>& x) {
@@ -57,8 +58,20 @@ std::ostream& operator<< (std::ostream& out, const std::map<u, v>& x) {
   return out;
 }
 
+template<typename v>
+std::ostream& operator<< (std::ostream& out, const player_table<v>& x) {
+  out << '[';
+  const char* separator = "";
+  for (const auto& [id, value] : x) {
+    out << separator << '<' << +id << ", " << value << '>';
+    separator = ", ";
+  }
+  out << ']';
+  return out;
+}
+
 std::ostream& operator<<(std::ostream& os, const streamable_buffer& s) {
-  os << s.buffer;
+  os << std::vector<unsigned char>(s.data().begin(), s.data().end());
   return os;
 }
 
@@ -75,19 +88,19 @@ std::ostream& operator<< (std::ostream& os, const Player& player) {
 }
 
 template<typename T, typename ... Args>
-void print(T t, Args ... args) {
+void print(const T& t, const Args& ... args) {
   std::cout << t;
   ((std::cout << ' ' << args), ...);
 }
 
 template<typename ... Args>
-void println([[maybe_unused]]Args ... args) {
+void println([[maybe_unused]]const Args& ... args) {
   print(args...);
   print('\n');
 }
 
 template<typename ... Args>
-void debug([[maybe_unused]]Args ... args) {
+void debug([[maybe_unused]]const Args& ... args) {
 #ifndef NDEBUG
   println(args...);
 #endif
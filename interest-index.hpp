@@ -0,0 +1,131 @@
+/* Spatial index of the events of a single turn, used by the server's
+ * interest management: every player gets only the events which happen
+ * within a given (Chebyshev) distance of their robot. Events are bucketed
+ * in a sparse grid of cells as wide as that distance, so selecting the
+ * events around a robot looks at its own cell and the 8 surrounding ones,
+ * and costs as much as the activity around the robot, not on the board.
+ */
+
+#ifndef BOMBERMAN_INTEREST_INDEX_HPP
+#define BOMBERMAN_INTEREST_INDEX_HPP
+
+#include <algorithm> // std::sort, std::max
+#include <cstdint>
+#include <cstdlib> // std::abs
+#include <unordered_map>
+#include <vector>
+
+#include "messages.hpp"
+
+class interest_index {
+  const pos_t radius;
+
+  const std::vector<Event>* events = nullptr;
+
+  // grid cell -> indices of the turn's events located in it
+  std::unordered_map<uint32_t, std::vector<uint32_t>> grid;
+  // events everybody gets: ones with no known location and ones which
+  // change what all the players see, i.e. destroyed robots and scores
+  std::vector<uint32_t> global;
+
+  // where the bombs placed in the previous turns are, to locate explosions
+  std::unordered_map<bomb_id_t, Position> bombs;
+
+  // index of the last selection which picked an event, to skip duplicates
+  std::vector<uint32_t> picked_by;
+  uint32_t selection = 0;
+
+  uint32_t cell_of(const Position& pos) const {
+    return static_cast<uint32_t>(pos.x / radius) << 16 | static_cast<uint32_t>(pos.y / radius);
+  }
+
+  bool near(const Position& a, const Position& b) const {
+    return std::abs(a.x - b.x) <= radius && std::abs(a.y - b.y) <= radius;
+  }
+
+  // Calls f on every position the event happens at
+  template <typename F>
+  void locate(const Event& event, F f) const {
+    if (auto e = std::get_if<EventBombExploded>(&event)) {
+      auto bomb = bombs.find(e->bomb_id);
+      if (bomb != bombs.end()) { f(bomb->second); }
+      for (const Position& pos : e->blocks_destroyed) { f(pos); }
+    } else {
+      std::visit([&f] (const auto& e) {
+        if constexpr (requires { e.position; }) { f(e.position); }
+      }, event);
+    }
+  }
+
+public:
+  explicit interest_index(pos_t radius) : radius(std::max<pos_t>(radius, 1)) {}
+
+  // Index the events of a new turn. They must outlive the selections.
+  void build(const std::vector<Event>& turn_events) {
+    events = &turn_events;
+    for (auto& [_, bucket] : grid) { bucket.clear(); }
+    global.clear();
+    picked_by.assign(turn_events.size(), 0);
+
+    for (uint32_t i=0; i < turn_events.size(); ++i) {
+      const Event& event = turn_events[i];
+      auto exploded = std::get_if<EventBombExploded>(&event);
+      bool located = false;
+      if (!exploded || exploded->robots_destroyed.empty()) {
+        locate(event, [this, i, &located] (const Position& pos) {
+          std::vector<uint32_t>& bucket = grid[cell_of(pos)];
+          if (bucket.empty() || bucket.back() != i) { bucket.push_back(i); }
+          located = true;
+        });
+      }
+      if (!located) { global.push_back(i); }
+
+      if (auto placed = std::get_if<EventBombPlaced>(&event)) {
+        bombs[placed->bomb_id] = placed->position;
+      } else if (exploded) {
+        bombs.erase(exploded->bomb_id);
+      }
+    }
+  }
+
+  // Indices, in order, of the events of the indexed turn which the robot
+  // standing at `center` should get
+  void select(const Position& center, std::vector<uint32_t>& selected) {
+    selected.clear();
+    if (++selection == 0) {
+      std::fill(picked_by.begin(), picked_by.end(), 0);
+      selection = 1;
+    }
+
+    selected.insert(selected.end(), global.begin(), global.end());
+    for (int dx = -1; dx <= 1; ++dx) {
+      for (int dy = -1; dy <= 1; ++dy) {
+        int x = center.x / radius + dx;
+        int y = center.y / radius + dy;
+        if (x < 0 || y < 0 || x > UINT16_MAX || y > UINT16_MAX) { continue; }
+
+        auto bucket = grid.find(static_cast<uint32_t>(x) << 16 | static_cast<uint32_t>(y));
+        if (bucket == grid.end()) { continue; }
+        for (uint32_t i : bucket->second) {
+          if (picked_by[i] == selection) { continue; }
+          bool in_range = false;
+          locate((*events)[i], [&] (const Position& pos) {
+            in_range = in_range || near(pos, center);
+          });
+          if (in_range) {
+            picked_by[i] = selection;
+            selected.push_back(i);
+          }
+        }
+      }
+    }
+    std::sort(selected.begin(), selected.end());
+  }
+
+  // Forget the bombs of a finished game
+  void clear() {
+    bombs.clear();
+  }
+};
+
+#endif // BOMBERMAN_INTEREST_INDEX_HPP
@@ -0,0 +1,521 @@
+/* Linux io_uring networking backend of the server, driven through the raw
+ * system calls. A single thread reaps the completions: it accepts with a
+ * multishot accept and receives with a multishot recv per connection, into a
+ * ring of buffers registered with the kernel, handing the bytes over to the
+ * sessions, which keep decoding on their own threads. Sends may be queued from
+ * any thread; within a send_batch they only reach the kernel, all with one
+ * io_uring_enter, when the batch closes. A connection has at most one send in
+ * flight and the data sent in the meantime is coalesced into the next one.
+ */
+
+#ifndef BOMBERMAN_IO_URING_BACKEND_HPP
+#define BOMBERMAN_IO_URING_BACKEND_HPP
+
+#include <algorithm> // std::max
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring> // std::memcpy, std::memset
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "connection.hpp"
+
+namespace uring {
+  // io_uring_enter calls made, for the benchmark
+  std::atomic<uint64_t> enters = 0;
+
+  int setup(unsigned entries, io_uring_params& params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+  }
+
+  int enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    enters.fetch_add(1, std::memory_order_relaxed);
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+  }
+
+  int register_ring(int fd, unsigned opcode, void* arg, unsigned args) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, args));
+  }
+
+  // The kernel takes no more submissions until completions are reaped
+  bool busy(int error) { return error == EAGAIN || error == EBUSY; }
+
+  [[noreturn]] void fail(const char* what) {
+    throw std::system_error(errno, std::generic_category(), what);
+  }
+
+  void* map(size_t size, int fd, off_t offset) {
+    void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    if (ptr == MAP_FAILED) { fail("io_uring mmap"); }
+    return ptr;
+  }
+
+  template <typename T>
+  T* at(void* base, uint32_t offset) {
+    return reinterpret_cast<T*>(static_cast<unsigned char*>(base) + offset);
+  }
+}
+
+class io_uring_backend;
+
+class io_uring_connection : public connection, public std::enable_shared_from_this<io_uring_connection> {
+  friend class io_uring_backend;
+
+  // a client which sends that much more than its session reads is cut off
+  static constexpr size_t max_inbox = 1 << 20;
+  // and so is one which reads that much less than is sent to it, where a
+  // blocking socket would block the sender instead
+  static constexpr size_t max_pending = 1 << 22;
+
+  io_uring_backend& backend;
+  const uint64_t id;
+  const int fd;
+  const boost::asio::ip::tcp::endpoint endpoint;
+
+  // bytes received, but not read by the session yet
+  std::mutex mutex_inbox;
+  std::condition_variable cond_inbox;
+  std::vector<unsigned char> inbox;
+  size_t inbox_head = 0;
+  bool eof = false;
+
+  // guarded by the backend's mutex_ring
+  std::vector<unsigned char> sending;
+  size_t sent = 0;
+  std::vector<unsigned char> pending;
+  bool receiving = true;
+  bool closed = false;
+
+  io_uring_connection(io_uring_backend& backend, uint64_t id, int fd, boost::asio::ip::tcp::endpoint endpoint)
+    : backend(backend), id(id), fd(fd), endpoint(endpoint) {}
+
+  void deliver(const unsigned char* data, size_t size) {
+    std::scoped_lock lock {mutex_inbox};
+    if (inbox.size() - inbox_head + size > max_inbox) {
+      ::shutdown(fd, SHUT_RDWR);
+      return;
+    }
+    if (inbox_head > inbox.size() / 2) {
+      inbox.erase(inbox.begin(), inbox.begin() + static_cast<std::ptrdiff_t>(inbox_head));
+      inbox_head = 0;
+    }
+    inbox.insert(inbox.end(), data, data + size);
+    cond_inbox.notify_one();
+  }
+
+  void close_inbox() {
+    std::scoped_lock lock {mutex_inbox};
+    eof = true;
+    cond_inbox.notify_one();
+  }
+
+public:
+  ~io_uring_connection() override { close(fd); }
+
+  void send(std::span<const unsigned char> data) override;
+
+  void read(std::span<unsigned char> out) override {
+    std::unique_lock lock {mutex_inbox};
+    cond_inbox.wait(lock,
+      [this, &out] { return inbox.size() - inbox_head >= out.size() || eof; }
+    );
+    if (inbox.size() - inbox_head < out.size()) {
+      throw boost::system::system_error(boost::asio::error::eof);
+    }
+    std::memcpy(out.data(), inbox.data() + inbox_head, out.size());
+    inbox_head += out.size();
+    if (inbox_head == inbox.size()) {
+      inbox.clear();
+      inbox_head = 0;
+    }
+  }
+
+  void shutdown() override { ::shutdown(fd, SHUT_RDWR); }
+
+  boost::asio::ip::tcp::endpoint remote_endpoint() const override { return endpoint; }
+};
+
+class io_uring_backend : public network_backend {
+  friend class io_uring_connection;
+
+  enum operation : uint64_t { op_accept, op_recv, op_send };
+
+  static constexpr unsigned queue_depth = 256;
+  static constexpr unsigned completion_depth = 4096;
+  // a power of 2, as the kernel requires
+  static constexpr unsigned recv_buffers = 256;
+  static constexpr unsigned recv_buffer_size = 4096;
+  static constexpr uint16_t recv_group = 0;
+
+  int ring_fd = -1;
+  unsigned sq_entries;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned* sq_array;
+  io_uring_sqe* sqes;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  io_uring_cqe* cqes;
+
+  io_uring_buf_ring* buf_ring;
+  std::vector<unsigned char> buf_memory;
+
+  int listen_fd = -1;
+
+  // guards the submission queue, the connections and their send state
+  std::mutex mutex_ring;
+  unsigned unsubmitted = 0;
+  unsigned batches = 0;
+  std::unordered_map<uint64_t, std::shared_ptr<io_uring_connection>> connections;
+  uint64_t next_id = 1;
+
+  // an accept to arm again, once the submission queue has room for it
+  bool accept_armed = false;
+
+  // Requires mutex_ring. Returns false if the kernel is busy; the rest is
+  // then left queued for the next flush. Other failures throw
+  // boost::system::system_error, as a broken connection does.
+  bool flush() {
+    while (unsubmitted > 0) {
+      int submitted = uring::enter(ring_fd, unsubmitted, 0, 0);
+      if (submitted < 0) {
+        if (errno == EINTR) { continue; }
+        if (uring::busy(errno)) { return false; }
+        throw boost::system::system_error(errno, boost::system::system_category(), "io_uring_enter");
+      }
+      unsubmitted -= static_cast<unsigned>(submitted);
+    }
+    return true;
+  }
+
+  bool queue_full() const {
+    return *sq_tail - std::atomic_ref(*sq_head).load(std::memory_order_acquire) == sq_entries;
+  }
+
+  // Queue a submission filled by `fill`; requires mutex_ring. Returns false
+  // if the queue is full and the kernel too busy to empty it.
+  template <typename F>
+  [[nodiscard]] bool submit(uint64_t id, operation op, F fill) {
+    if (queue_full() && (!flush() || queue_full())) { return false; }
+    unsigned tail = *sq_tail;
+    unsigned index = tail & sq_mask;
+    io_uring_sqe& sqe = sqes[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    fill(sqe);
+    sqe.user_data = id << 2 | op;
+    sq_array[index] = index;
+    std::atomic_ref(*sq_tail).store(tail + 1, std::memory_order_release);
+
+    ++unsubmitted;
+    if (batches == 0) { flush(); }
+    return true;
+  }
+
+  [[nodiscard]] bool arm_accept() {
+    return submit(0, op_accept, [this] (io_uring_sqe& sqe) {
+      sqe.opcode = IORING_OP_ACCEPT;
+      sqe.fd = listen_fd;
+      sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+      sqe.accept_flags = SOCK_CLOEXEC;
+    });
+  }
+
+  [[nodiscard]] bool arm_recv(const io_uring_connection& conn) {
+    return submit(conn.id, op_recv, [&conn] (io_uring_sqe& sqe) {
+      sqe.opcode = IORING_OP_RECV;
+      sqe.fd = conn.fd;
+      sqe.ioprio = IORING_RECV_MULTISHOT;
+      sqe.flags = IOSQE_BUFFER_SELECT;
+      sqe.buf_group = recv_group;
+    });
+  }
+
+  [[nodiscard]] bool arm_send(const io_uring_connection& conn) {
+    return submit(conn.id, op_send, [&conn] (io_uring_sqe& sqe) {
+      sqe.opcode = IORING_OP_SEND;
+      sqe.fd = conn.fd;
+      sqe.addr = reinterpret_cast<uint64_t>(conn.sending.data() + conn.sent);
+      sqe.len = static_cast<uint32_t>(conn.sending.size() - conn.sent);
+      sqe.msg_flags = MSG_NOSIGNAL;
+    });
+  }
+
+  unsigned char* recv_buffer(uint16_t bid) {
+    return buf_memory.data() + static_cast<size_t>(bid) * recv_buffer_size;
+  }
+
+  // Give buffers back to the kernel; requires mutex_ring
+  void recycle(uint16_t first, uint16_t count) {
+    // not through buf_ring->bufs, which C++ places past the empty struct
+    // the kernel header pads the flexible array with
+    io_uring_buf* bufs = reinterpret_cast<io_uring_buf*>(buf_ring);
+    uint16_t tail = buf_ring->tail;
+    for (uint16_t i=0; i < count; ++i) {
+      io_uring_buf& buf = bufs[(tail + i) & (recv_buffers - 1)];
+      buf.addr = reinterpret_cast<uint64_t>(recv_buffer(static_cast<uint16_t>(first + i)));
+      buf.len = recv_buffer_size;
+      buf.bid = static_cast<uint16_t>(first + i);
+    }
+    std::atomic_ref(buf_ring->tail).store(static_cast<uint16_t>(tail + count), std::memory_order_release);
+  }
+
+  // The connection can't be sent to any more; requires that no send is in
+  // flight
+  void abort_sends(io_uring_connection& conn) {
+    conn.closed = true;
+    conn.sending.clear();
+    conn.pending.clear();
+    ::shutdown(conn.fd, SHUT_RDWR);
+    retire(conn);
+  }
+
+  // A connection is forgotten once the kernel is done with it
+  void retire(const io_uring_connection& conn) {
+    if (!conn.receiving && conn.sending.empty()) { connections.erase(conn.id); }
+  }
+
+  std::shared_ptr<io_uring_connection> open(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    sockaddr_storage addr {};
+    socklen_t len = sizeof(addr);
+    boost::asio::ip::tcp::endpoint endpoint;
+    if (getpeername(fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0 || len > endpoint.capacity()) {
+      close(fd);
+      return nullptr;
+    }
+    std::memcpy(endpoint.data(), &addr, len);
+    endpoint.resize(len);
+
+    std::shared_ptr<io_uring_connection> conn {new io_uring_connection(*this, next_id++, fd, endpoint)};
+    connections[conn->id] = conn;
+    if (!arm_recv(*conn)) {
+      // closed along with the last reference
+      connections.erase(conn->id);
+      return nullptr;
+    }
+    return conn;
+  }
+
+  // Requires mutex_ring
+  void complete(uint64_t user_data, int res, uint32_t flags,
+                std::vector<std::shared_ptr<connection>>& accepted) {
+    uint64_t id = user_data >> 2;
+    bool more = flags & IORING_CQE_F_MORE;
+
+    if ((user_data & 3) == op_accept) {
+      if (res >= 0) {
+        if (auto conn = open(res)) { accepted.push_back(conn); }
+      }
+      if (!more) { accept_armed = arm_accept(); }
+      return;
+    }
+
+    auto it = connections.find(id);
+    if ((user_data & 3) == op_recv && (flags & IORING_CQE_F_BUFFER)) {
+      uint16_t bid = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+      if (res > 0 && it != connections.end()) {
+        it->second->deliver(recv_buffer(bid), static_cast<size_t>(res));
+      }
+      recycle(bid, 1);
+    }
+    if (it == connections.end()) { return; }
+    std::shared_ptr<io_uring_connection> conn = it->second;
+
+    if ((user_data & 3) == op_recv) {
+      if (more) { return; }
+      // the kernel ends a multishot recv when it runs out of buffers
+      if ((res > 0 || res == -ENOBUFS) && arm_recv(*conn)) { return; }
+      // like a blocking socket, it may still be written to after the peer's FIN
+      if (res > 0 || res == -ENOBUFS) { ::shutdown(conn->fd, SHUT_RDWR); }
+      conn->receiving = false;
+      conn->close_inbox();
+      retire(*conn);
+      return;
+    }
+
+    if (res < 0) {
+      abort_sends(*conn);
+      return;
+    }
+    conn->sent += static_cast<size_t>(res);
+    if (conn->sent == conn->sending.size()) {
+      conn->sending.clear();
+      conn->sent = 0;
+      std::swap(conn->sending, conn->pending);
+    }
+    if (conn->sending.empty()) {
+      retire(*conn);
+    } else if (!arm_send(*conn)) {
+      abort_sends(*conn);
+    }
+  }
+
+  void listen(port_t port) {
+    listen_fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) { uring::fail("socket"); }
+    int one = 1;
+    int zero = 0;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+
+    sockaddr_in6 addr {};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_port = htons(port);
+    addr.sin6_addr = in6addr_any;
+    if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) { uring::fail("bind"); }
+    if (::listen(listen_fd, SOMAXCONN) != 0) { uring::fail("listen"); }
+  }
+
+public:
+  io_uring_backend() : buf_memory(static_cast<size_t>(recv_buffers) * recv_buffer_size) {
+    io_uring_params params {};
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+    params.cq_entries = completion_depth;
+    ring_fd = uring::setup(queue_depth, params);
+    if (ring_fd < 0) { uring::fail("io_uring_setup"); }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    void* sq_ring;
+    void* cq_ring;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      sq_ring = cq_ring = uring::map(std::max(sq_size, cq_size), ring_fd, IORING_OFF_SQ_RING);
+    } else {
+      sq_ring = uring::map(sq_size, ring_fd, IORING_OFF_SQ_RING);
+      cq_ring = uring::map(cq_size, ring_fd, IORING_OFF_CQ_RING);
+    }
+    sqes = static_cast<io_uring_sqe*>(
+      uring::map(params.sq_entries * sizeof(io_uring_sqe), ring_fd, IORING_OFF_SQES)
+    );
+
+    sq_entries = params.sq_entries;
+    sq_head = uring::at<unsigned>(sq_ring, params.sq_off.head);
+    sq_tail = uring::at<unsigned>(sq_ring, params.sq_off.tail);
+    sq_mask = *uring::at<unsigned>(sq_ring, params.sq_off.ring_mask);
+    sq_array = uring::at<unsigned>(sq_ring, params.sq_off.array);
+    cq_head = uring::at<unsigned>(cq_ring, params.cq_off.head);
+    cq_tail = uring::at<unsigned>(cq_ring, params.cq_off.tail);
+    cq_mask = *uring::at<unsigned>(cq_ring, params.cq_off.ring_mask);
+    cqes = uring::at<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+
+    // the provided buffer ring the multishot receives pick their buffers from
+    void* ring = mmap(nullptr, recv_buffers * sizeof(io_uring_buf), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) { uring::fail("mmap"); }
+    buf_ring = static_cast<io_uring_buf_ring*>(ring);
+    buf_ring->tail = 0;
+    io_uring_buf_reg reg {};
+    reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+    reg.ring_entries = recv_buffers;
+    reg.bgid = recv_group;
+    if (uring::register_ring(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+      uring::fail("io_uring_register");
+    }
+    recycle(0, recv_buffers);
+  }
+
+  // the ring lives as long as the server, which never stops serving
+  io_uring_backend(const io_uring_backend&) = delete;
+  io_uring_backend& operator=(const io_uring_backend&) = delete;
+
+  void serve(port_t port, accept_handler on_accept) override {
+    listen(port);
+    {
+      std::scoped_lock lock {mutex_ring};
+      accept_armed = arm_accept();
+    }
+
+    std::vector<std::shared_ptr<connection>> accepted;
+    while (true) {
+      // a busy kernel has completions for us to reap
+      if (uring::enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR && !uring::busy(errno)) {
+        uring::fail("io_uring_enter");
+      }
+      {
+        std::scoped_lock lock {mutex_ring};
+        unsigned head = *cq_head;
+        unsigned tail = std::atomic_ref(*cq_tail).load(std::memory_order_acquire);
+        for (; head != tail; ++head) {
+          io_uring_cqe cqe = cqes[head & cq_mask];
+          // given back right away, to make room for the completions of what
+          // is submitted while handling it
+          std::atomic_ref(*cq_head).store(head + 1, std::memory_order_release);
+          try {
+            complete(cqe.user_data, cqe.res, cqe.flags, accepted);
+          } catch (const boost::system::system_error& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+          }
+        }
+        try {
+          if (!accept_armed) { accept_armed = arm_accept(); }
+          flush();
+        } catch (const boost::system::system_error& e) {
+          // left queued, the next flush submits them
+          std::cerr << "Error: " << e.what() << std::endl;
+        }
+      }
+      // outside of the lock, since the handler may already send something
+      for (auto& conn : accepted) { on_accept(std::move(conn)); }
+      accepted.clear();
+    }
+  }
+
+  void begin_batch() override {
+    std::scoped_lock lock {mutex_ring};
+    ++batches;
+  }
+
+  void end_batch() override {
+    std::scoped_lock lock {mutex_ring};
+    if (--batches > 0) { return; }
+    try {
+      flush();
+    } catch (const boost::system::system_error& e) {
+      // left queued, the next flush submits them
+      std::cerr << "Error: " << e.what() << std::endl;
+    }
+  }
+};
+
+void io_uring_connection::send(std::span<const unsigned char> data) {
+  if (data.empty()) { return; }
+  std::scoped_lock lock {backend.mutex_ring};
+  if (closed) {
+    throw boost::system::system_error(boost::asio::error::broken_pipe);
+  }
+  if (sending.empty()) {
+    sending.assign(data.begin(), data.end());
+    // kept alive by the backend until the kernel is done with the data
+    backend.connections.try_emplace(id, shared_from_this());
+    if (!backend.arm_send(*this)) {
+      backend.abort_sends(*this);
+      throw boost::system::system_error(boost::asio::error::broken_pipe);
+    }
+  } else if (pending.size() + data.size() > max_pending) {
+    // the send in flight fails on the shut socket and retires the connection
+    closed = true;
+    pending.clear();
+    ::shutdown(fd, SHUT_RDWR);
+    throw boost::system::system_error(boost::asio::error::broken_pipe);
+  } else {
+    pending.insert(pending.end(), data.begin(), data.end());
+  }
+}
+
+#endif // BOMBERMAN_IO_URING_BACKEND_HPP
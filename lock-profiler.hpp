@@ -0,0 +1,295 @@
+/* Mutexes which can tell which of them the server waits for. The server's
+ * mutexes are profiled_mutexes, locked with profiled_lock. If the server is
+ * built with BOMBERMAN_LOCK_PROFILING (the CMake option of the same name),
+ * every acquisition records how long it waited for the mutex and how long it
+ * then held it, in histograms of powers of two nanoseconds, per mutex and
+ * per call site. Without it they are a std::mutex and a guard, nothing more.
+ *
+ * Every thread records into a table of its own, after the mutex is released,
+ * so that recording neither contends nor adds to the hold times; report()
+ * merges the tables.
+ */
+
+#ifndef BOMBERMAN_LOCK_PROFILER_HPP
+#define BOMBERMAN_LOCK_PROFILER_HPP
+
+#include <array>
+#include <mutex>
+#include <source_location>
+
+#ifdef BOMBERMAN_LOCK_PROFILING
+#include <algorithm> // std::min
+#include <bit> // std::bit_width
+#include <chrono>
+#include <compare>
+#include <csignal>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <pthread.h>
+
+namespace lock_profiler {
+  using clock = std::chrono::steady_clock;
+
+  // Bucket i counts the times of less than 2^i ns (and at least half that)
+  constexpr size_t buckets = 40;
+
+  struct histogram {
+    std::array<uint64_t, buckets> counts {};
+
+    void add(uint64_t ns) {
+      ++counts[std::min(static_cast<size_t>(std::bit_width(ns)), buckets - 1)];
+    }
+
+    histogram& operator+=(const histogram& other) {
+      for (size_t i=0; i < buckets; ++i) { counts[i] += other.counts[i]; }
+      return *this;
+    }
+  };
+
+  struct site_stats {
+    uint64_t acquisitions = 0;
+    uint64_t wait_ns = 0;
+    uint64_t hold_ns = 0;
+    histogram wait;
+    histogram hold;
+
+    site_stats& operator+=(const site_stats& other) {
+      acquisitions += other.acquisitions;
+      wait_ns += other.wait_ns;
+      hold_ns += other.hold_ns;
+      wait += other.wait;
+      hold += other.hold;
+      return *this;
+    }
+  };
+
+  // The strings are those of std::source_location and of the mutex's name,
+  // the same pointers every time for a site
+  struct site_key {
+    const char* mutex;
+    const char* function;
+    uint_least32_t line;
+
+    auto operator<=>(const site_key&) const = default;
+  };
+
+  struct thread_table {
+    std::mutex mutex;
+    std::map<site_key, site_stats> sites;
+  };
+
+  std::mutex mutex_tables;
+  std::vector<std::shared_ptr<thread_table>> tables;
+
+  // where the thread is locking; set by profiled_lock
+  thread_local std::source_location current_site;
+
+  thread_table& own_table() {
+    thread_local std::shared_ptr<thread_table> table = [] {
+      auto table = std::make_shared<thread_table>();
+      std::scoped_lock lock {mutex_tables};
+      tables.push_back(table);
+      return table;
+    }();
+    return *table;
+  }
+
+  void record(const site_key& key, uint64_t wait_ns, uint64_t hold_ns) {
+    thread_table& table = own_table();
+    std::scoped_lock lock {table.mutex};
+    site_stats& stats = table.sites[key];
+    ++stats.acquisitions;
+    stats.wait_ns += wait_ns;
+    stats.hold_ns += hold_ns;
+    stats.wait.add(wait_ns);
+    stats.hold.add(hold_ns);
+  }
+
+  // The bound below which the given share of the times fall
+  uint64_t percentile(const histogram& h, uint64_t total, double share) {
+    uint64_t seen = 0;
+    for (size_t i=0; i < buckets; ++i) {
+      seen += h.counts[i];
+      if (static_cast<double>(seen) >= share * static_cast<double>(total)) { return uint64_t {1} << i; }
+    }
+    return uint64_t {1} << (buckets - 1);
+  }
+
+  void print_histogram(std::ostream& out, const histogram& h) {
+    for (size_t i=0; i < buckets; ++i) {
+      if (h.counts[i] > 0) { out << " <" << (uint64_t {1} << i) << ':' << h.counts[i]; }
+    }
+  }
+
+  // Every mutex and call site, the most waited for first
+  void report(std::ostream& out) {
+    std::map<std::tuple<std::string, std::string, uint_least32_t>, site_stats> merged;
+    {
+      std::scoped_lock lock {mutex_tables};
+      for (const auto& table : tables) {
+        std::scoped_lock lock_table {table->mutex};
+        for (const auto& [key, stats] : table->sites) {
+          merged[{key.mutex, key.function, key.line}] += stats;
+        }
+      }
+    }
+
+    std::vector<std::pair<std::tuple<std::string, std::string, uint_least32_t>, site_stats>> sites (merged.begin(), merged.end());
+    std::sort(sites.begin(), sites.end(), [] (const auto& a, const auto& b) {
+      return a.second.wait_ns > b.second.wait_ns;
+    });
+
+    out << "Lock profile (times in ns):\n";
+    for (const auto& [key, stats] : sites) {
+      const auto& [mutex, function, line] = key;
+      out << mutex << " in " << function << ':' << line << '\n'
+          << "  acquired " << stats.acquisitions
+          << ", waited " << stats.wait_ns
+          << " (p50 <" << percentile(stats.wait, stats.acquisitions, 0.5)
+          << ", p99 <" << percentile(stats.wait, stats.acquisitions, 0.99) << ")"
+          << ", held " << stats.hold_ns
+          << " (p50 <" << percentile(stats.hold, stats.acquisitions, 0.5)
+          << ", p99 <" << percentile(stats.hold, stats.acquisitions, 0.99) << ")\n"
+          << "  wait";
+      print_histogram(out, stats.wait);
+      out << "\n  hold";
+      print_histogram(out, stats.hold);
+      out << '\n';
+    }
+    out.flush();
+  }
+
+  // Reports to std::cout when the process gets SIGINT or SIGTERM, and then
+  // dies of it as it would have. To be called before starting any threads,
+  // so that they inherit the signals blocked for sigwait.
+  void report_on_termination() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    std::thread([signals] {
+      int received = 0;
+      sigwait(&signals, &received);
+      report(std::cout);
+      std::signal(received, SIG_DFL);
+      pthread_sigmask(SIG_UNBLOCK, &signals, nullptr);
+      std::raise(received);
+    }).detach();
+  }
+}
+#endif // BOMBERMAN_LOCK_PROFILING
+
+class profiled_mutex {
+  std::mutex mutex;
+  // which locks the std::mutex itself and notes the acquisition once it
+  // holds all of its mutexes
+  friend class profiled_lock;
+
+#ifdef BOMBERMAN_LOCK_PROFILING
+  const char* const name;
+  // of the current holder
+  std::source_location site;
+  lock_profiler::clock::time_point acquired;
+  uint64_t waited = 0;
+
+  void note_acquired(lock_profiler::clock::time_point start) {
+    acquired = lock_profiler::clock::now();
+    site = lock_profiler::current_site;
+    waited = static_cast<uint64_t>(std::chrono::nanoseconds {acquired - start}.count());
+  }
+
+public:
+  explicit profiled_mutex(const char* name) : name(name) {}
+
+  void lock() {
+    lock_profiler::clock::time_point start = lock_profiler::clock::now();
+    mutex.lock();
+    note_acquired(start);
+  }
+
+  bool try_lock() {
+    if (!mutex.try_lock()) { return false; }
+    note_acquired(lock_profiler::clock::now());
+    return true;
+  }
+
+  void unlock() {
+    lock_profiler::clock::time_point released = lock_profiler::clock::now();
+    lock_profiler::site_key key {.mutex = name, .function = site.function_name(), .line = site.line()};
+    uint64_t wait_ns = waited;
+    uint64_t hold_ns = static_cast<uint64_t>(std::chrono::nanoseconds {released - acquired}.count());
+    mutex.unlock();
+    lock_profiler::record(key, wait_ns, hold_ns);
+  }
+#else
+public:
+  explicit profiled_mutex([[maybe_unused]]const char* name) {}
+
+  void lock() { mutex.lock(); }
+  bool try_lock() { return mutex.try_lock(); }
+  void unlock() { mutex.unlock(); }
+#endif
+};
+
+// A mutex to lock, and where it's locked; converted to from the mutex at the
+// call site, so the site is that of the statement taking the lock
+struct lock_site {
+  profiled_mutex& mutex;
+  std::source_location where;
+
+  lock_site(profiled_mutex& mutex, std::source_location where = std::source_location::current())
+    : mutex(mutex), where(where) {}
+};
+
+// Like std::scoped_lock, for up to three mutexes, locked together without
+// deadlock; also lockable itself, so that a std::condition_variable_any can
+// wait on it
+class profiled_lock {
+  std::array<profiled_mutex*, 3> mutexes {};
+  size_t count;
+  std::source_location where;
+
+public:
+  explicit profiled_lock(lock_site a) : mutexes {&a.mutex}, count(1), where(a.where) { lock(); }
+
+  profiled_lock(lock_site a, lock_site b)
+    : mutexes {&a.mutex, &b.mutex}, count(2), where(a.where) { lock(); }
+
+  profiled_lock(lock_site a, lock_site b, lock_site c)
+    : mutexes {&a.mutex, &b.mutex, &c.mutex}, count(3), where(a.where) { lock(); }
+
+  ~profiled_lock() { unlock(); }
+
+  profiled_lock(const profiled_lock&) = delete;
+  profiled_lock& operator=(const profiled_lock&) = delete;
+
+  void lock() {
+#ifdef BOMBERMAN_LOCK_PROFILING
+    lock_profiler::current_site = where;
+    lock_profiler::clock::time_point start = lock_profiler::clock::now();
+#endif
+    // std::lock tries and backs off, which mustn't count as acquisitions
+    if (count == 1) { mutexes[0]->mutex.lock(); }
+    else if (count == 2) { std::lock(mutexes[0]->mutex, mutexes[1]->mutex); }
+    else { std::lock(mutexes[0]->mutex, mutexes[1]->mutex, mutexes[2]->mutex); }
+#ifdef BOMBERMAN_LOCK_PROFILING
+    for (size_t i=0; i < count; ++i) { mutexes[i]->note_acquired(start); }
+#endif
+  }
+
+  void unlock() {
+    for (size_t i = count; i > 0; --i) { mutexes[i - 1]->unlock(); }
+  }
+};
+
+#endif // BOMBERMAN_LOCK_PROFILER_HPP
@@ -8,6 +8,8 @@
  *  will be assigned
  * Name of the 'msg_id' member is not to be changed - objects are tested
  * for presence of such a member in the serialization code
+ * Protocol extensions are only ever appended at the end of the variants, so
+ * that the ids of the original messages stay the same for legacy peers.
  */
 
 #ifndef BOMBERMAN_MESSAGES_HPP
@@ -25,6 +27,7 @@ using bomb_timer_t = uint16_t;
 // we could use an enum, but this is just more convenient for serialization
 using direction_t = uint8_t;
 using explosion_radius_t = uint16_t;
+using features_t = uint8_t;
 using game_length_t = uint16_t;
 using initial_blocks_t = uint16_t;
 using msg_id_t = uint8_t;
@@ -37,6 +40,12 @@ using strlen_t = uint8_t;
 using turn_duration_t = uint64_t;
 using turn_t = uint16_t;
 
+// Optional protocol extensions, requested with ClientMessageNegotiate
+constexpr features_t FEATURE_COMPACT = 1 << 0;
+constexpr features_t FEATURE_UDP = 1 << 1;
+constexpr features_t FEATURE_RESUME = 1 << 2;
+constexpr features_t FEATURE_STATE_HASH = 1 << 3;
+
 struct Position {
   pos_t x;
   pos_t y;
@@ -104,11 +113,35 @@ struct ClientMessageMove {
   direction_t direction;
 };
 
+// Sent only by clients which want some of the FEATURE_* extensions
+struct ClientMessageNegotiate {
+  static constexpr uint8_t msg_id = 4;
+  features_t features;
+};
+
+// Over the UDP channel: the turns which got lost, to be sent over TCP
+struct ClientMessageResendTurns {
+  static constexpr uint8_t msg_id = 5;
+  turn_t first;
+  turn_t count;
+};
+
+// Sent by a client which lost its connection, on a new one: the token of its
+// player and the first turn it hasn't got
+struct ClientMessageResume {
+  static constexpr uint8_t msg_id = 6;
+  uint64_t token;
+  turn_t next_turn;
+};
+
 using ClientMessage = std::variant<
   ClientMessageJoin, 
   ClientMessagePlaceBomb,
   ClientMessagePlaceBlock,
-  ClientMessageMove
+  ClientMessageMove,
+  ClientMessageNegotiate,
+  ClientMessageResendTurns,
+  ClientMessageResume
 >;
 
 // Definitions of messages from server to client ---------------------------
@@ -145,12 +178,52 @@ struct ServerMessageGameEnded {
   std::map<player_id_t, score_t> scores;
 };
 
+// Reply to ClientMessageNegotiate with the subset of features granted.
+// It is the last message encoded in the legacy format for that client.
+struct ServerMessageNegotiated {
+  static constexpr uint8_t msg_id = 5;
+  features_t features;
+};
+
+// Follows ServerMessageNegotiated granting FEATURE_UDP: the token which the
+// client's datagrams carry
+struct ServerMessageChannel {
+  static constexpr uint8_t msg_id = 6;
+  uint32_t token;
+};
+
+// With FEATURE_RESUME, follows the ServerMessageAcceptedPlayer of a client's
+// own player, to that client only: the token to get the player back with
+struct ServerMessageResumeToken {
+  static constexpr uint8_t msg_id = 7;
+  uint64_t token;
+};
+
+// Reply to ClientMessageResume; if accepted, the turns missed follow it
+struct ServerMessageResumed {
+  static constexpr uint8_t msg_id = 8;
+  uint8_t accepted;
+};
+
+// With FEATURE_STATE_HASH, follows every few turns: the hash of the state
+// after the given turn (see state-hash.hpp)
+struct ServerMessageStateHash {
+  static constexpr uint8_t msg_id = 9;
+  turn_t turn;
+  uint64_t hash;
+};
+
 using ServerMessage = std::variant<
   ServerMessageHello, 
   ServerMessageAcceptedPlayer, 
   ServerMessageGameStarted, 
   ServerMessageTurn, 
-  ServerMessageGameEnded
+  ServerMessageGameEnded,
+  ServerMessageNegotiated,
+  ServerMessageChannel,
+  ServerMessageResumeToken,
+  ServerMessageResumed,
+  ServerMessageStateHash
 >;
 
 // Definitions of messages from client to GUI server -----------------------
@@ -181,7 +254,37 @@ struct DrawMessageGame {
   std::map<player_id_t, score_t> scores;
 };
 
-using DrawMessage = std::variant<DrawMessageLobby, DrawMessageGame>;
+// In the delta frames mode, sent in place of DrawMessageGame when the GUI
+// already has the frame of the previous turn: only what changed since then.
+// The new blocks are placed before the destroyed ones are removed.
+struct DrawMessageGameDelta {
+  static constexpr uint8_t msg_id = 2;
+  turn_t turn;
+  std::map<player_id_t, Position> player_positions;
+  std::vector<Position> blocks_placed;
+  std::vector<Position> blocks_destroyed;
+  std::vector<Bomb> bombs;
+  std::vector<Position> explosions;
+  std::map<player_id_t, score_t> scores;
+};
+
+// A piece of a draw message too long for a single datagram. The pieces of
+// one message share the `frame` number; the GUI concatenates their bytes in
+// the order of `index` once all `count` of them have arrived.
+struct DrawMessageFragment {
+  static constexpr uint8_t msg_id = 3;
+  uint32_t frame;
+  uint16_t index;
+  uint16_t count;
+  std::vector<uint8_t> bytes;
+};
+
+using DrawMessage = std::variant<
+  DrawMessageLobby,
+  DrawMessageGame,
+  DrawMessageGameDelta,
+  DrawMessageFragment
+>;
 
 // Definitions of messages from GUI server to client -----------------------
 struct InputMessagePlaceBomb {
@@ -197,10 +300,16 @@ struct InputMessageMove {
   direction_t direction;
 };
 
+// A GUI which missed a delta frame asks for a full one
+struct InputMessageResync {
+  static constexpr uint8_t msg_id = 3;
+};
+
 using InputMessage = std::variant<
   InputMessagePlaceBomb,
   InputMessagePlaceBlock,
-  InputMessageMove
+  InputMessageMove,
+  InputMessageResync
 >;
 
 #endif // BOMBERMAN_MESSAGES_HPP
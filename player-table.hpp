@@ -0,0 +1,171 @@
+/* Per-player state indexed directly by player id. Ids are a single byte, so
+ * a table is a fixed array of 256 slots plus a bitmask of the occupied ones:
+ * a lookup is an index, iteration a scan of the mask in increasing ids (the
+ * order of the std::map it replaces) and clearing zeroes the mask. Tables of
+ * one field each, side by side, make a structure of arrays. On the wire a
+ * table is encoded as that std::map.
+ */
+
+#ifndef BOMBERMAN_PLAYER_TABLE_HPP
+#define BOMBERMAN_PLAYER_TABLE_HPP
+
+#include <array>
+#include <bit> // std::countr_zero, std::popcount
+#include <cstdint>
+#include <map>
+#include <stdexcept>
+#include <utility>
+
+#include "messages.hpp"
+#include "serialization.hpp"
+#include "streamable-buffer.hpp"
+
+constexpr size_t player_slots = size_t {1} << (8 * sizeof(player_id_t));
+
+// A set of player ids, e.g. the occupied slots of a table
+class player_set {
+  static constexpr size_t word_bits = 64;
+  std::array<uint64_t, player_slots / word_bits> words {};
+
+  static uint64_t bit(player_id_t id) { return uint64_t {1} << (id % word_bits); }
+
+  // The first id in the set from `from` on, or player_slots if there's none
+  size_t find_next(size_t from) const {
+    for (size_t w = from / word_bits; w < words.size(); ++w) {
+      uint64_t bits = words[w];
+      if (w == from / word_bits) { bits &= ~uint64_t {0} << (from % word_bits); }
+      if (bits != 0) { return w * word_bits + static_cast<size_t>(std::countr_zero(bits)); }
+    }
+    return player_slots;
+  }
+
+public:
+  class iterator {
+    const player_set* set;
+    size_t id;
+
+  public:
+    iterator(const player_set* set, size_t id) : set(set), id(id) {}
+
+    player_id_t operator*() const { return static_cast<player_id_t>(id); }
+
+    iterator& operator++() {
+      id = set->find_next(id + 1);
+      return *this;
+    }
+
+    bool operator==(const iterator& other) const { return id == other.id; }
+  };
+
+  iterator begin() const { return iterator {this, find_next(0)}; }
+  iterator end() const { return iterator {this, player_slots}; }
+
+  bool contains(player_id_t id) const { return (words[id / word_bits] & bit(id)) != 0; }
+
+  // Returns false if the id was there already
+  bool insert(player_id_t id) {
+    if (contains(id)) { return false; }
+    words[id / word_bits] |= bit(id);
+    return true;
+  }
+
+  void erase(player_id_t id) { words[id / word_bits] &= ~bit(id); }
+
+  void clear() { words.fill(0); }
+
+  size_t size() const {
+    size_t count = 0;
+    for (uint64_t word : words) { count += static_cast<size_t>(std::popcount(word)); }
+    return count;
+  }
+
+  bool empty() const { return begin() == end(); }
+};
+
+template <typename T>
+class player_table {
+  player_set occupied;
+  std::array<T, player_slots> slots {};
+
+  template <typename Table, typename Value>
+  class basic_iterator {
+    Table* table;
+    player_set::iterator id;
+
+  public:
+    basic_iterator(Table* table, player_set::iterator id) : table(table), id(id) {}
+
+    // bound with `const auto& [id, value]`, or `auto [id, value]` to modify
+    // the values
+    std::pair<player_id_t, Value&> operator*() const { return {*id, table->slots[*id]}; }
+
+    basic_iterator& operator++() {
+      ++id;
+      return *this;
+    }
+
+    bool operator==(const basic_iterator& other) const { return id == other.id; }
+  };
+
+public:
+  using iterator = basic_iterator<player_table, T>;
+  using const_iterator = basic_iterator<const player_table, const T>;
+
+  iterator begin() { return iterator {this, occupied.begin()}; }
+  iterator end() { return iterator {this, occupied.end()}; }
+  const_iterator begin() const { return const_iterator {this, occupied.begin()}; }
+  const_iterator end() const { return const_iterator {this, occupied.end()}; }
+
+  bool contains(player_id_t id) const { return occupied.contains(id); }
+  size_t size() const { return occupied.size(); }
+  bool empty() const { return occupied.empty(); }
+  const player_set& ids() const { return occupied; }
+
+  // Like std::map's: a missing player is added with a default value
+  T& operator[](player_id_t id) {
+    if (occupied.insert(id)) { slots[id] = T {}; }
+    return slots[id];
+  }
+
+  T& at(player_id_t id) {
+    if (!contains(id)) { throw std::out_of_range("No such player"); }
+    return slots[id];
+  }
+
+  const T& at(player_id_t id) const {
+    if (!contains(id)) { throw std::out_of_range("No such player"); }
+    return slots[id];
+  }
+
+  // nullptr if there's no such player
+  T* find(player_id_t id) { return contains(id) ? &slots[id] : nullptr; }
+  const T* find(player_id_t id) const { return contains(id) ? &slots[id] : nullptr; }
+
+  // Returns false, leaving the value as it is, if the player is there already
+  bool insert(player_id_t id, T value) {
+    if (!occupied.insert(id)) { return false; }
+    slots[id] = std::move(value);
+    return true;
+  }
+
+  void erase(player_id_t id) { occupied.erase(id); }
+
+  // The values are left behind and overwritten when their slot is reused
+  void clear() { occupied.clear(); }
+
+  // From the std::map of the wire format
+  void assign(std::map<player_id_t, T>&& values) {
+    clear();
+    for (auto& [id, value] : values) { insert(id, std::move(value)); }
+  }
+};
+
+// The layout of the std::map<player_id_t, T> it replaces
+template <typename T>
+streamable_buffer& operator<<(streamable_buffer& stream, const player_table<T>& table) {
+  stream << static_cast<uint32_t>(table.size());
+  for (const auto& [id, value] : table) { stream << id << value; }
+  return stream;
+}
+
+#endif // BOMBERMAN_PLAYER_TABLE_HPP
@@ -1,10 +1,22 @@
 #ifndef BOMBERMAN_RESOLVE_ADDRESS_HPP
 #define BOMBERMAN_RESOLVE_ADDRESS_HPP
 
+#include <algorithm> // std::max
+#include <chrono>
 #include <cstdint> // uint16_t
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <sstream>
 #include <stdexcept> // std::runtime_error
 #include <string>
 #include <utility> // std::pair
+#include <vector>
+
+#include <fcntl.h> // open
+#include <sys/file.h> // flock
+#include <unistd.h> // close
 
 #include <boost/asio.hpp> // io_service
 
@@ -52,5 +64,264 @@ typename resolver_t::results_type resolve_address(
   }                                                                          
 } 
 
+// Addresses of the hosts resolved in the last `ttl`. Kept in memory and, if
+// given a path, in a file shared with the other clients on the host, so that
+// a lot of them started at once ask the resolver only a few times.
+class resolution_cache {
+  using clock = std::chrono::system_clock;
+
+  struct entry {
+    clock::time_point expiry;
+    std::vector<boost::asio::ip::address> addresses;
+  };
+
+  const std::chrono::seconds ttl;
+  const std::optional<std::string> path;
+  std::map<std::string, entry> entries;
+
+  // The file has a line per host: its name, the expiry in seconds since the
+  // epoch and the addresses
+  static std::map<std::string, entry> parse(const std::string& contents) {
+    std::map<std::string, entry> parsed;
+    std::istringstream lines {contents};
+    std::string line;
+    while (std::getline(lines, line)) {
+      std::istringstream fields {line};
+      std::string host;
+      int64_t expiry;
+      if (!(fields >> host >> expiry)) { continue; }
+      entry e {.expiry = clock::time_point {std::chrono::seconds {expiry}}, .addresses = {}};
+      std::string address;
+      boost::system::error_code error;
+      while (fields >> address) {
+        auto parsed_address = boost::asio::ip::make_address(address, error);
+        if (!error) { e.addresses.push_back(parsed_address); }
+      }
+      if (e.expiry > clock::now() && !e.addresses.empty()) { parsed[host] = std::move(e); }
+    }
+    return parsed;
+  }
+
+  static std::string read_all(int fd) {
+    std::string contents;
+    char chunk[4096];
+    ssize_t n;
+    lseek(fd, 0, SEEK_SET);
+    while ((n = ::read(fd, chunk, sizeof(chunk))) > 0) {
+      contents.append(chunk, static_cast<size_t>(n));
+    }
+    return contents;
+  }
+
+public:
+  explicit resolution_cache(std::chrono::seconds ttl, std::optional<std::string> path = std::nullopt)
+    : ttl(ttl), path(std::move(path)) {}
+
+  std::optional<std::vector<boost::asio::ip::address>> lookup(const std::string& host) {
+    auto it = entries.find(host);
+    if (it != entries.end() && it->second.expiry > clock::now()) { return it->second.addresses; }
+    if (!path) { return std::nullopt; }
+
+    int fd = open(path->c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { return std::nullopt; }
+    flock(fd, LOCK_SH);
+    std::map<std::string, entry> shared = parse(read_all(fd));
+    close(fd);
+    for (auto& [name, e] : shared) {
+      auto known = entries.find(name);
+      if (known == entries.end() || known->second.expiry < e.expiry) {
+        entries.insert_or_assign(name, std::move(e));
+      }
+    }
+    it = entries.find(host);
+    if (it != entries.end() && it->second.expiry > clock::now()) { return it->second.addresses; }
+    return std::nullopt;
+  }
+
+  void store(const std::string& host, const std::vector<boost::asio::ip::address>& addresses) {
+    entries[host] = entry {.expiry = clock::now() + ttl, .addresses = addresses};
+    if (!path) { return; }
+
+    int fd = open(path->c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) { return; }
+    flock(fd, LOCK_EX);
+    std::map<std::string, entry> shared = parse(read_all(fd));
+    shared[host] = entries[host];
+    std::ostringstream contents;
+    for (const auto& [name, e] : shared) {
+      contents << name << ' ' << std::chrono::duration_cast<std::chrono::seconds>(e.expiry.time_since_epoch()).count();
+      for (const auto& address : e.addresses) { contents << ' ' << address; }
+      contents << '\n';
+    }
+    std::string bytes = contents.str();
+    if (ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0) {
+      [[maybe_unused]] ssize_t written = ::write(fd, bytes.data(), bytes.size());
+    }
+    close(fd);
+  }
+};
+
+// Resolve address of the form "<ipv4/ipv6/hostname>:<port>" in the
+// background of `io_service`, or from the cache, and pass the endpoints to
+// `on_resolved`. Failures are thrown out of io_service.run().
+template <typename resolver_t>
+void async_resolve_address(
+    const std::string& addr,
+    boost::asio::io_service& io_service,
+    resolution_cache& cache,
+    std::function<void(std::vector<typename resolver_t::endpoint_type>)> on_resolved
+) {
+  using endpoint_t = typename resolver_t::endpoint_type;
+  auto [host, port] = split_port(addr);
+
+  // literal addresses need no resolver, nor caching
+  boost::system::error_code literal_error;
+  boost::asio::ip::address literal = boost::asio::ip::make_address(host, literal_error);
+  std::optional<std::vector<boost::asio::ip::address>> cached;
+  if (!literal_error) {
+    cached = std::vector {literal};
+  } else {
+    cached = cache.lookup(host);
+  }
+  if (cached) {
+    std::vector<endpoint_t> endpoints;
+    for (const auto& address : *cached) { endpoints.emplace_back(address, port); }
+    boost::asio::post(io_service, [on_resolved, endpoints = std::move(endpoints)] () mutable {
+      on_resolved(std::move(endpoints));
+    });
+    return;
+  }
+
+  auto resolver = std::make_shared<resolver_t>(io_service);
+  resolver->async_resolve(host, std::to_string(port),
+    [resolver, addr, host, &cache, on_resolved] (
+      const boost::system::error_code& error,
+      typename resolver_t::results_type results
+    ) {
+      if (error || results.empty()) {
+        throw addr_resolution_error("Unable to resolve address: " + addr);
+      }
+      std::vector<endpoint_t> endpoints;
+      std::vector<boost::asio::ip::address> addresses;
+      for (const auto& result : results) {
+        endpoints.push_back(result.endpoint());
+        addresses.push_back(result.endpoint().address());
+      }
+      cache.store(host, addresses);
+      on_resolved(std::move(endpoints));
+    }
+  );
+}
+
+// Connects the socket to the first of the endpoints to accept, Happy Eyeballs
+// style (RFC 8305): IPv6 and IPv4 endpoints take turns, and the next attempt
+// starts as soon as the previous one fails or once it has been pending for
+// the attempt delay, without giving up on it. Calls on_connected once
+// connected; if all of them fail, the last error is thrown out of
+// io_service.run().
+class connection_race : public std::enable_shared_from_this<connection_race> {
+  using tcp = boost::asio::ip::tcp;
+
+  boost::asio::io_service& io_service;
+  tcp::socket& result;
+  std::vector<tcp::endpoint> endpoints;
+  std::function<void()> on_connected;
+  const std::chrono::milliseconds attempt_delay;
+
+  std::vector<std::unique_ptr<tcp::socket>> attempts;
+  boost::asio::steady_timer timer;
+  size_t failed = 0;
+  bool done = false;
+
+  // Alternate the address families, starting with that of the first one
+  static std::vector<tcp::endpoint> interleave(const std::vector<tcp::endpoint>& endpoints) {
+    std::vector<tcp::endpoint> first, second;
+    for (const auto& endpoint : endpoints) {
+      bool same = endpoint.address().is_v6() == endpoints.front().address().is_v6();
+      (same ? first : second).push_back(endpoint);
+    }
+    std::vector<tcp::endpoint> ordered;
+    for (size_t i=0; i < std::max(first.size(), second.size()); ++i) {
+      if (i < first.size()) { ordered.push_back(first[i]); }
+      if (i < second.size()) { ordered.push_back(second[i]); }
+    }
+    return ordered;
+  }
+
+  void attempt_next() {
+    if (done || attempts.size() == endpoints.size()) { return; }
+    const tcp::endpoint& endpoint = endpoints[attempts.size()];
+    attempts.push_back(std::make_unique<tcp::socket>(io_service));
+    tcp::socket& sock = *attempts.back();
+    auto self = shared_from_this();
+    sock.async_connect(endpoint, [self, &sock] (const boost::system::error_code& error) {
+      self->attempt_finished(sock, error);
+    });
+    timer.expires_after(attempt_delay);
+    timer.async_wait([self] (const boost::system::error_code& error) {
+      if (!error) { self->attempt_next(); }
+    });
+  }
+
+  void attempt_finished(tcp::socket& sock, const boost::system::error_code& error) {
+    if (done) { return; }
+    if (error) {
+      if (++failed == endpoints.size()) {
+        done = true;
+        timer.cancel();
+        throw boost::system::system_error(error);
+      }
+      // don't wait for the delay of the failed one
+      attempt_next();
+      return;
+    }
+
+    done = true;
+    timer.cancel();
+    for (auto& attempt : attempts) {
+      if (attempt.get() != &sock) {
+        boost::system::error_code ignored;
+        attempt->close(ignored);
+      }
+    }
+    result = std::move(sock);
+    on_connected();
+  }
+
+public:
+  connection_race(
+    boost::asio::io_service& io_service,
+    tcp::socket& result,
+    const std::vector<tcp::endpoint>& endpoints,
+    std::function<void()> on_connected,
+    std::chrono::milliseconds attempt_delay
+  ) : io_service(io_service),
+      result(result),
+      endpoints(interleave(endpoints)),
+      on_connected(std::move(on_connected)),
+      attempt_delay(attempt_delay),
+      timer(io_service) {}
+
+  void start() {
+    if (endpoints.empty()) {
+      throw boost::system::system_error(boost::asio::error::host_not_found);
+    }
+    attempt_next();
+  }
+};
+
+// The connection attempt delay recommended by RFC 8305
+constexpr std::chrono::milliseconds default_attempt_delay {250};
+
+void async_connect_racing(
+    boost::asio::ip::tcp::socket& sock,
+    const std::vector<boost::asio::ip::tcp::endpoint>& endpoints,
+    boost::asio::io_service& io_service,
+    std::function<void()> on_connected,
+    std::chrono::milliseconds attempt_delay = default_attempt_delay
+) {
+  std::make_shared<connection_race>(io_service, sock, endpoints, std::move(on_connected), attempt_delay)->start();
+}
+
 #endif // BOMBERMAN_RESOLVE_ADDRESS_HPP
 
@@ -1,14 +1,30 @@
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
 #include <variant>
 #include <iostream>
+#include <mutex>
 #include <optional>
 
 #include <boost/program_options.hpp>
 #include <boost/asio.hpp>
 
+#include "blast-map.hpp"
+#include "bomb-table.hpp"
+#include "connection.hpp"
 #include "resolve-address.hpp"
 #include "streamable-buffer.hpp"
 #include "serialization.hpp"
 #include "messages.hpp"
+#include "player-table.hpp"
+#include "state-hash.hpp"
+#include "udp-channel.hpp"
+
+#if __has_include(<sys/eventfd.h>)
+#define BOMBERMAN_HAS_SHM
+#include "shm-transport.hpp"
+#endif
 
 #include "debug.hpp"
 
@@ -22,18 +38,84 @@ enum ClientState {
   Finish
 };
 
+// Turns carry the whole initial board, so be generous, but not unbounded
+constexpr streamable_buffer::decode_limits server_msg_limits {
+  .max_bytes = 1 << 24,
+  .max_elements = 1 << 20
+};
+
 volatile std::sig_atomic_t client_state = ClientState::Lobby;
 std::string player_name;
 
-ip::udp::resolver::results_type gui_endpoints;
+ip::udp::endpoint gui_endpoint;
 
 void send(streamable_buffer& stream, ip::udp::socket& sock) {
-  auto buffer = stream.get_buffer();
-  const std::vector<unsigned char>& data { buffer.begin(), buffer.end() };
-  sock.send_to(boost::asio::buffer(data), *gui_endpoints);
+  auto data = stream.data();
+  sock.send_to(boost::asio::buffer(data.data(), data.size()), gui_endpoint);
+  stream.clear();
+}
+
+// the GUI thread sends inputs while the others may ask for lost turns;
+// also guards server_conn, which a resume replaces
+std::mutex mutex_server_send;
+std::shared_ptr<connection> server_conn;
+
+void send_to_server(streamable_buffer& stream) {
+  std::scoped_lock lock {mutex_server_send};
+  send(stream, *server_conn);
+}
+
+// Session resume (FEATURE_RESUME): if the connection breaks while we play,
+// connect again and take our player back with the token
+bool reconnect = false;
+// connects to the server anew and negotiates the same features
+std::function<std::shared_ptr<connection>()> connect_server;
+// the token of our player, while there is one; guarded by mutex_game
+std::optional<uint64_t> resume_token;
+// whether the server is yet to answer a resume; guarded by mutex_game
+bool resuming = false;
+// the Hello of the new connection, applied only if the resume fails
+std::optional<ServerMessageHello> pending_hello;
+
+// The UDP game channel, if asked for; open once the server sends the token
+std::optional<ip::udp::socket> game_socket;
+uint32_t udp_token;
+std::atomic<bool> udp_open = false;
+std::atomic<uint32_t> udp_sequence = 0;
+loss_injector udp_loss;
+turn_sequencer sequencer;
+
+void begin_datagram(streamable_buffer& stream) {
+  stream << udp_token << udp_sequence++;
+}
+
+void send_datagram(streamable_buffer& stream) {
+  auto data = stream.data();
+  for (size_t i=0; i < udp_input_copies; ++i) {
+    if (udp_loss.drop_next()) { continue; }
+    game_socket->send(boost::asio::buffer(data.data(), data.size()));
+  }
   stream.clear();
 }
 
+// Tells the server where to send the turns
+void register_game_socket() {
+  streamable_buffer sbuffer;
+  begin_datagram(sbuffer);
+  try {
+    send_datagram(sbuffer);
+  } catch (const boost::system::system_error& e) {
+    std::cerr << "UDP write failed\n";
+  }
+}
+
+// Everything which the turns change, i.e. game_state, the sequencer and the
+// frames drawn from them, is guarded by this, as the turns come over both
+// TCP and UDP
+std::mutex mutex_game;
+// the format of the turns in datagrams; guarded by mutex_game
+wire_format server_format = wire_format::legacy;
+
 struct game_state_t {
   std::string server_name;
   players_count_t players_count;
@@ -44,153 +126,342 @@ struct game_state_t {
   bomb_timer_t bomb_timer;
   turn_t turn;
 
-  std::map<player_id_t, Player> players;
-  std::map<player_id_t, bool> killed;
-  std::map<player_id_t, Position> player_positions;
+  // indexed by player id; encoded as the maps of the draw messages
+  player_table<Player> players;
+  player_set killed;
+  player_table<Position> player_positions;
   std::vector<Position> blocks;
-  std::set<Position> blocks_destroyed;
-  std::vector<Bomb> bombs;
-  std::map<bomb_id_t, Position> bombs_positions;
+  blast_map blast;
+  // of the turn being applied
+  board_changes changes;
+  bomb_table bombs;
   std::vector<Position> explosions;
-  std::map<player_id_t, score_t> scores;
+  player_table<score_t> scores;
+  state_hash hash;
 } game_state;
 
+// With FEATURE_STATE_HASH: our hash of the state after every turn applied,
+// and the server's ones for the turns not applied yet, as they may come
+// over UDP after the hash
+std::map<turn_t, uint64_t> turn_hashes;
+std::map<turn_t, uint64_t> expected_hashes;
+uint64_t divergences = 0;
+
+void check_state_hash(turn_t turn, uint64_t ours, uint64_t servers) {
+  if (ours == servers) { return; }
+  ++divergences;
+  std::cerr << "State diverged from the server's in turn " << turn << std::endl;
+}
+
+// What changed in game_state since the last frame sent to the GUI, for the
+// delta frames mode
+struct draw_changes_t {
+  player_set moved;
+  std::vector<Position> blocks_placed;
+  std::vector<Position> blocks_destroyed;
+  player_set scored;
+
+  void clear() {
+    moved.clear();
+    blocks_placed.clear();
+    blocks_destroyed.clear();
+    scored.clear();
+  }
+} draw_changes;
+
+// A full frame is sent every that many turns, deltas in between; 0 if every
+// frame is a full one
+game_length_t delta_interval = 0;
+game_length_t frames_since_full = 0;
+// set when the game starts and when the GUI asks for it
+std::atomic<bool> full_frame_due = true;
+// the turn of the last frame sent, if it was a game frame: deltas only ever
+// follow the frame of the previous turn
+std::optional<turn_t> last_drawn_turn;
+
 void handle_event(const EventBombPlaced& e) {
   println("Bomb placed:", e.position);
-  game_state.bombs.push_back(Bomb {e.position, game_state.bomb_timer});
-  game_state.bombs_positions[e.bomb_id] = e.position;
+  if (game_state.bombs.place(e.bomb_id, e.position, game_state.turn)) {
+    game_state.hash.toggle_bomb(e.bomb_id, e.position);
+  }
 }
 
 void handle_event(const EventBombExploded& e) {
-  pos_t x0 = game_state.bombs_positions[e.bomb_id].x;
-  pos_t y0 = game_state.bombs_positions[e.bomb_id].y;
-  println("Bomb exploded at:", x0, y0);
-
-  game_state.explosions.push_back(Position {.x=x0, .y=y0});
-  
-  std::vector<std::pair<int, int>> diffs = {
-    { 0, -1},
-    { 0,  1},
-    { 1,  0},
-    {-1,  0}
-  };
-  for (auto [dx, dy] : diffs) {
-    int x = x0;
-    int y = y0;
-
-    // if the explosion's arm encountered a block on its way,
-    // don't propagate further
-    bool blocked = false;
-
-    for (pos_t t = 0; t <= game_state.explosion_radius && !blocked; ++t) {
-      Position pos = Position {
-        .x = static_cast<pos_t>(x),
-        .y = static_cast<pos_t>(y)
-      };
-
-      bool init = dx == 0 && dy == -1;
-      if (!(init && t==0)) {
-        game_state.explosions.push_back(pos);
-      }
-
-      for (const Position& block_pos : game_state.blocks) {
-        if (block_pos == pos) { blocked = true; break; }
-      }
-
-      x += dx;
-      y += dy;
-      if (x < 0 || x >= game_state.size_x) { break; }
-      if (y < 0 || y >= game_state.size_y) { break; }
-    }
-  };
+  std::optional<Position> bomb_position = game_state.bombs.position(e.bomb_id);
+  if (bomb_position) {
+    println("Bomb exploded at:", *bomb_position);
+    // the blast itself is resolved with the other ones at the end of the turn
+    game_state.changes.exploded_bombs.push_back(*bomb_position);
+    game_state.bombs.remove(e.bomb_id);
+    game_state.hash.toggle_bomb(e.bomb_id, *bomb_position);
+  }
 
   for (const player_id_t& player_id : e.robots_destroyed) {
-    game_state.killed[player_id] = true;
+    game_state.killed.insert(player_id);
   }
 
   for (const Position& pos : e.blocks_destroyed) {
-    game_state.blocks_destroyed.insert(pos);
+    game_state.changes.blocks_destroyed.insert(pos);
   }
-
-  // remove the bomb
-  // find the bomb's position
-  auto bomb_position_it = game_state.bombs_positions.find(e.bomb_id);
-  if (bomb_position_it == game_state.bombs_positions.end()) { return; }
-  Position pos = bomb_position_it->second;
-
-  // find the bomb
-  auto bomb_it = std::find_if(
-    game_state.bombs.begin(),
-    game_state.bombs.end(),
-    [pos](auto& x) { return x.position == pos; }
-  );
-  if (bomb_it == game_state.bombs.end()) { return; }
-  game_state.bombs.erase(bomb_it);
 }
 
 void handle_event(const EventPlayerMoved& e) {
   println("Player moved to:", e.position);
-  game_state.player_positions[e.player_id] = e.position;
+  if (Position* pos = game_state.player_positions.find(e.player_id)) {
+    game_state.hash.move_robot(e.player_id, *pos, e.position);
+    *pos = e.position;
+  } else {
+    game_state.player_positions.insert(e.player_id, e.position);
+    game_state.hash.toggle_robot(e.player_id, e.position);
+  }
+  draw_changes.moved.insert(e.player_id);
 }
 
 void handle_event(const EventBlockPlaced& e) {
   println("Block placed at:", e.position);
-  game_state.blocks.push_back(e.position);
+  // only after the turn's blasts, which it mustn't stop
+  game_state.changes.blocks_placed.push_back(e.position);
 }
 
-void prepare_draw_message(DrawMessage& msg) {
-  std::visit (
-    [](auto& msg) {
-      msg.server_name = game_state.server_name;
-      msg.size_x = game_state.size_x;
-      msg.size_y = game_state.size_y;
-      msg.game_length = game_state.game_length;
-      msg.players = game_state.players;
-    },
-    msg
-  );
+// The fields of the draw messages which only change with the server's Hello
+// or with the set of players, pre-encoded; frames are put together from them
+// and the dynamic fields, encoded straight out of game_state.
+struct draw_template_t {
+  // DrawMessageLobby up to bomb_timer, DrawMessageGame up to game_length
+  std::vector<unsigned char> lobby_head;
+  std::vector<unsigned char> game_head;
+  std::vector<unsigned char> players;
+} draw_template;
+
+// reused for every frame, so that drawing doesn't allocate
+streamable_buffer gui_buffer;
+std::vector<Bomb> drawn_bombs;
+
+void take_bytes(streamable_buffer& stream, std::vector<unsigned char>& bytes) {
+  std::span<const unsigned char> data = stream.data();
+  bytes.assign(data.begin(), data.end());
+  stream.clear();
+}
+
+// After the Hello
+void update_draw_heads() {
+  gui_buffer << DrawMessageLobby::msg_id
+             << game_state.server_name
+             << game_state.players_count
+             << game_state.size_x
+             << game_state.size_y
+             << game_state.game_length
+             << game_state.explosion_radius
+             << game_state.bomb_timer;
+  take_bytes(gui_buffer, draw_template.lobby_head);
+
+  gui_buffer << DrawMessageGame::msg_id
+             << game_state.server_name
+             << game_state.size_x
+             << game_state.size_y
+             << game_state.game_length;
+  take_bytes(gui_buffer, draw_template.game_head);
+}
+
+// After every change of game_state.players
+void update_draw_players() {
+  gui_buffer << game_state.players;
+  take_bytes(gui_buffer, draw_template.players);
+}
+
+void write_bytes(streamable_buffer& stream, const std::vector<unsigned char>& bytes) {
+  stream.write(bytes.data(), bytes.size());
+}
+
+// What to do with draw messages which don't fit in a datagram; only GUIs
+// which know DrawMessageFragment can take fragments
+enum class oversize_policy { fragment, clip };
+
+std::istream& operator>>(std::istream& in, oversize_policy& policy) {
+  std::string name;
+  in >> name;
+  if (name == "fragment") { policy = oversize_policy::fragment; }
+  else if (name == "clip") { policy = oversize_policy::clip; }
+  else { in.setstate(std::ios_base::failbit); }
+  return in;
 }
 
-DrawMessageLobby prepare_message(DrawMessageLobby&& msg) {
-  msg.server_name = game_state.server_name;
-  msg.size_x = game_state.size_x;
-  msg.size_y = game_state.size_y;
-  msg.game_length = game_state.game_length;
-  msg.players = game_state.players;
-  msg.players_count = game_state.players_count;
-  msg.explosion_radius = game_state.explosion_radius;
-  msg.bomb_timer = game_state.bomb_timer;
+std::ostream& operator<<(std::ostream& out, oversize_policy policy) {
+  return out << (policy == oversize_policy::fragment ? "fragment" : "clip");
+}
+
+oversize_policy oversize = oversize_policy::clip;
+size_t max_gui_datagram = MAX_UDP_MESSAGE_SIZE;
+
+struct gui_stats_t {
+  uint64_t frames = 0;
+  uint64_t oversize = 0;
+  uint64_t fragmented = 0;
+  uint64_t clipped = 0;
+  uint64_t dropped = 0;
+} gui_stats;
+
+// How the server sees this client, to tell which of the players it is
+std::vector<std::string> own_addresses;
+
+streamable_buffer fragment_buffer;
+uint32_t fragment_frame = 0;
+
+// The layout of DrawMessageFragment
+void send_fragments(ip::udp::socket& gui_socket) {
+  constexpr size_t header = sizeof(msg_id_t) + sizeof(uint32_t) + 2 * sizeof(uint16_t) + sizeof(uint32_t);
+  std::span<const unsigned char> data = gui_buffer.data();
+  size_t chunk = max_gui_datagram - header;
+  size_t count = (data.size() + chunk - 1) / chunk;
+  if (count > std::numeric_limits<uint16_t>::max()) {
+    ++gui_stats.dropped;
+    gui_buffer.clear();
+    return;
+  }
 
-  return msg;
+  ++fragment_frame;
+  for (size_t i=0; i < count; ++i) {
+    std::span<const unsigned char> piece = data.subspan(i * chunk, std::min(chunk, data.size() - i * chunk));
+    fragment_buffer << DrawMessageFragment::msg_id
+                    << fragment_frame
+                    << static_cast<uint16_t>(i)
+                    << static_cast<uint16_t>(count)
+                    << static_cast<uint32_t>(piece.size());
+    fragment_buffer.write(piece.data(), piece.size());
+    send(fragment_buffer, gui_socket);
+  }
+  ++gui_stats.fragmented;
+  gui_buffer.clear();
 }
 
-DrawMessageGame prepare_message(DrawMessageGame&& msg) {
-  msg.server_name = game_state.server_name;
-  msg.size_x = game_state.size_x;
-  msg.size_y = game_state.size_y;
-  msg.game_length = game_state.game_length;
-  msg.players = game_state.players;
-  msg.turn = game_state.turn;
-  msg.player_positions = game_state.player_positions;
-  msg.blocks = game_state.blocks;
-  msg.bombs = game_state.bombs;
-  msg.explosions = game_state.explosions;
-  msg.scores = game_state.scores;
+void encode_clipped_game();
 
-  return msg;
+// Send the draw message encoded in gui_buffer, according to the oversize
+// policy if it doesn't fit in a datagram
+void send_frame(ip::udp::socket& gui_socket, bool game_frame) {
+  ++gui_stats.frames;
+  if (gui_buffer.size() > max_gui_datagram) {
+    ++gui_stats.oversize;
+    if (oversize == oversize_policy::fragment) {
+      send_fragments(gui_socket);
+      return;
+    }
+    if (game_frame) {
+      encode_clipped_game();
+    }
+    if (gui_buffer.size() > max_gui_datagram) {
+      ++gui_stats.dropped;
+      gui_buffer.clear();
+      return;
+    }
+    ++gui_stats.clipped;
+  }
+  send(gui_buffer, gui_socket);
 }
 
 void send_lobby(ip::udp::socket& gui_socket) {
-  streamable_buffer s;
-  s << prepare_message(DrawMessageLobby {});
-  send(s, gui_socket);
+  last_drawn_turn = std::nullopt;
+  write_bytes(gui_buffer, draw_template.lobby_head);
+  write_bytes(gui_buffer, draw_template.players);
+  send_frame(gui_socket, false);
+}
+
+// The square of cells within `radius` of `center`
+struct viewport_t {
+  Position center;
+  pos_t radius;
+
+  bool contains(const Position& pos) const {
+    return std::abs(pos.x - center.x) <= radius && std::abs(pos.y - center.y) <= radius;
+  }
+};
+
+template <typename T, typename Keep>
+void encode_filtered(streamable_buffer& stream, const std::vector<T>& items, Keep keep) {
+  stream << static_cast<uint32_t>(std::count_if(items.begin(), items.end(), keep));
+  for (const T& item : items) {
+    if (keep(item)) { stream << item; }
+  }
+}
+
+// The layout of DrawMessageGame; only the cells within the viewport, if any
+void encode_full_game(const std::optional<viewport_t>& viewport = std::nullopt) {
+  write_bytes(gui_buffer, draw_template.game_head);
+  gui_buffer << game_state.turn;
+  write_bytes(gui_buffer, draw_template.players);
+  game_state.bombs.draw(game_state.turn, drawn_bombs);
+  gui_buffer << game_state.player_positions;
+  if (viewport) {
+    auto visible = [&viewport] (const Position& pos) { return viewport->contains(pos); };
+    encode_filtered(gui_buffer, game_state.blocks, visible);
+    encode_filtered(gui_buffer, drawn_bombs, [&visible] (const Bomb& bomb) { return visible(bomb.position); });
+    encode_filtered(gui_buffer, game_state.explosions, visible);
+  } else {
+    gui_buffer << game_state.blocks
+               << drawn_bombs
+               << game_state.explosions;
+  }
+  gui_buffer << game_state.scores;
+}
+
+// A full frame of the cells around our robot, or the middle of the board
+// if it isn't known, shrunk until it fits
+void encode_clipped_game() {
+  Position center {
+    .x = static_cast<pos_t>(game_state.size_x / 2),
+    .y = static_cast<pos_t>(game_state.size_y / 2)
+  };
+  for (const auto& [player_id, player] : game_state.players) {
+    const Position* pos = game_state.player_positions.find(player_id);
+    if (pos && std::find(own_addresses.begin(), own_addresses.end(), player.address) != own_addresses.end()) {
+      center = *pos;
+    }
+  }
+
+  pos_t radius = std::max(game_state.size_x, game_state.size_y);
+  do {
+    radius = static_cast<pos_t>(radius / 2);
+    gui_buffer.clear();
+    encode_full_game(viewport_t {.center = center, .radius = radius});
+  } while (gui_buffer.size() > max_gui_datagram && radius > 0);
+  // what's missing from a clipped frame can't be patched with deltas
+  full_frame_due = true;
+}
+
+// The layout of DrawMessageGameDelta
+void encode_game_delta() {
+  gui_buffer << DrawMessageGameDelta::msg_id << game_state.turn;
+  gui_buffer << static_cast<uint32_t>(draw_changes.moved.size());
+  for (player_id_t player_id : draw_changes.moved) {
+    gui_buffer << player_id << game_state.player_positions.at(player_id);
+  }
+  game_state.bombs.draw(game_state.turn, drawn_bombs);
+  gui_buffer << draw_changes.blocks_placed
+             << draw_changes.blocks_destroyed
+             << drawn_bombs
+             << game_state.explosions;
+  gui_buffer << static_cast<uint32_t>(draw_changes.scored.size());
+  for (player_id_t player_id : draw_changes.scored) {
+    gui_buffer << player_id << game_state.scores.at(player_id);
+  }
 }
 
 void send_game(ip::udp::socket& gui_socket) {
-  streamable_buffer s;
-  s << prepare_message(DrawMessageGame {});
-  send(s, gui_socket);
-  game_state.explosions = {};
+  bool follows = last_drawn_turn && *last_drawn_turn + 1 == game_state.turn;
+  bool full = delta_interval == 0
+    || full_frame_due.exchange(false)
+    || !follows
+    || ++frames_since_full >= delta_interval;
+  if (full) {
+    encode_full_game();
+    frames_since_full = 0;
+  } else {
+    encode_game_delta();
+  }
+  send_frame(gui_socket, true);
+  last_drawn_turn = game_state.turn;
+  draw_changes.clear();
+  game_state.explosions.clear();
 }
 
 void handle_server_msg(
@@ -198,6 +469,11 @@ void handle_server_msg(
   ip::udp::socket& gui_socket
 ) {
   println("Hello!");
+  if (resuming) {
+    // the game goes on, if the resume succeeds
+    pending_hello = msg;
+    return;
+  }
   game_state.server_name = msg.server_name;
   game_state.players_count = msg.players_count;
   game_state.size_x = msg.size_x;
@@ -205,58 +481,96 @@ void handle_server_msg(
   game_state.game_length = msg.game_length;
   game_state.explosion_radius = msg.explosion_radius;
   game_state.bomb_timer = msg.bomb_timer;
+  game_state.blast = blast_map(msg.size_x, msg.size_y);
+  game_state.bombs = bomb_table(msg.bomb_timer);
+  update_draw_heads();
+  update_draw_players();
 
   send_lobby(gui_socket);
 }
 
 void handle_server_msg(
-  const ServerMessageAcceptedPlayer& msg,
+  ServerMessageAcceptedPlayer&& msg,
   ip::udp::socket& gui_socket
 ) {
   println("Accepted player:", msg.player.name);
-  game_state.players[msg.player_id] = msg.player;
+  game_state.players[msg.player_id] = std::move(msg.player);
   game_state.scores[msg.player_id] = 0;
+  update_draw_players();
   send_lobby(gui_socket);
 }
 
+void apply_sequenced_turns(ip::udp::socket& gui_socket);
+
 void handle_server_msg(
-  [[maybe_unused]]const ServerMessageGameStarted& msg,
-  [[maybe_unused]]ip::udp::socket& gui_socket
+  ServerMessageGameStarted&& msg,
+  ip::udp::socket& gui_socket
 ) {
   println("Game started");
   client_state = ClientState::Playing;
-  game_state.players = msg.players;
-  for (auto [player_id, player] : msg.players) {
+  game_state.players.assign(std::move(msg.players));
+  for (const auto& [player_id, player] : game_state.players) {
     game_state.scores[player_id] = 0;
   }
+  update_draw_players();
+  full_frame_due = true;
+
+  // the first turns may have come over UDP already
+  sequencer.start();
+  if (udp_open) {
+    register_game_socket();
+    apply_sequenced_turns(gui_socket);
+  }
 }
 
-void handle_server_msg(
+void apply_turn(
   const ServerMessageTurn& msg,
   ip::udp::socket& gui_socket
 ) {
   println("Turn:", msg.turn);
-  for (Bomb& bomb : game_state.bombs) {
-    if(bomb.timer) bomb.timer--;
-  }
+  game_state.turn = msg.turn;
 
   for (const Event& e : msg.events) {
     std::visit([](auto& x){ handle_event(x); }, e);
   }
 
-  for (auto& [player_id, killed] : game_state.killed) {
-    if (killed) { game_state.scores[player_id]++; }
-    killed = false; // important: we bind by reference
+  for (player_id_t player_id : game_state.killed) {
+    game_state.scores[player_id]++;
+    draw_changes.scored.insert(player_id);
   }
+  game_state.killed.clear();
   
-  for (const Position& pos : game_state.blocks_destroyed) {
-    auto it = std::find(game_state.blocks.begin(), game_state.blocks.end(), pos);
-    if (it == game_state.blocks.end()) { continue; }
-    game_state.blocks.erase(it);
-  }
+  // before the turn's blocks are placed, which may be where others went
+  std::erase_if(game_state.blocks, [](const Position& pos) {
+    return game_state.changes.blocks_destroyed.contains(pos);
+  });
+  // all the blasts of the turn see the board from before any of them
+  game_state.changes.resolve(
+    game_state.blast,
+    game_state.explosion_radius,
+    game_state.explosions,
+    [] (const Position& pos) {
+      draw_changes.blocks_destroyed.push_back(pos);
+      game_state.hash.toggle_block(pos);
+    },
+    [] (const Position& pos) {
+      game_state.blocks.push_back(pos);
+      game_state.hash.toggle_block(pos);
+      draw_changes.blocks_placed.push_back(pos);
+    }
+  );
 
-  game_state.blocks_destroyed = {};
-  game_state.turn = msg.turn;
+  game_state.bombs.expire(msg.turn, [] (bomb_id_t bomb_id, const Position& pos) {
+    game_state.hash.toggle_bomb(bomb_id, pos);
+  });
+
+  uint64_t hash = game_state.hash.get();
+  turn_hashes[msg.turn] = hash;
+  auto expected = expected_hashes.find(msg.turn);
+  if (expected != expected_hashes.end()) {
+    check_state_hash(msg.turn, hash, expected->second);
+    expected_hashes.erase(expected);
+  }
 
   std::sort(game_state.explosions.begin(), game_state.explosions.end());
   auto last = std::unique(game_state.explosions.begin(), game_state.explosions.end());
@@ -265,22 +579,113 @@ void handle_server_msg(
   send_game(gui_socket);
 }
 
+void apply_sequenced_turns(ip::udp::socket& gui_socket) {
+  sequencer.drain([&gui_socket] (const ServerMessageTurn& turn) { apply_turn(turn, gui_socket); });
+}
+
 void handle_server_msg(
-  [[maybe_unused]]const ServerMessageGameEnded& msg,
+  ServerMessageTurn&& msg,
   ip::udp::socket& gui_socket
 ) {
-  println("Game ended");
+  // a resume brings the missed turns, which may come after or along with
+  // the broadcast ones
+  if (!udp_open && !resume_token) {
+    apply_turn(msg, gui_socket);
+    return;
+  }
+  sequencer.offer_stream(std::move(msg));
+  apply_sequenced_turns(gui_socket);
+}
+
+void handle_server_msg(
+  const ServerMessageNegotiated& msg,
+  [[maybe_unused]]ip::udp::socket& gui_socket
+) {
+  println("Negotiated features:", +msg.features);
+}
+
+void handle_server_msg(
+  const ServerMessageChannel& msg,
+  [[maybe_unused]]ip::udp::socket& gui_socket
+) {
+  println("UDP channel open");
+  if (!game_socket) { return; }
+  udp_token = msg.token;
+  udp_open = true;
+  register_game_socket();
+}
+
+void reset_to_lobby(ip::udp::socket& gui_socket) {
   client_state = ClientState::Lobby;
   game_state.turn = 0;
-  game_state.players = {};
-  game_state.killed = {};
-  game_state.player_positions = {};
+  game_state.players.clear();
+  update_draw_players();
+  game_state.killed.clear();
+  game_state.player_positions.clear();
   game_state.blocks = {};
-  game_state.bombs = {};
-  game_state.bombs_positions = {};
+  game_state.blast.clear();
+  game_state.changes.clear();
+  game_state.bombs.clear();
+  draw_changes.clear();
+  sequencer.end();
+  resume_token = std::nullopt;
+  game_state.hash.clear();
+  turn_hashes.clear();
+  expected_hashes.clear();
   send_lobby(gui_socket);
 }
 
+void handle_server_msg(
+  [[maybe_unused]]const ServerMessageGameEnded& msg,
+  ip::udp::socket& gui_socket
+) {
+  println("Game ended");
+  println("GUI frames:", gui_stats.frames,
+          "oversize:", gui_stats.oversize,
+          "fragmented:", gui_stats.fragmented,
+          "clipped:", gui_stats.clipped,
+          "dropped:", gui_stats.dropped);
+  if (divergences > 0) { println("State divergences:", divergences); }
+  reset_to_lobby(gui_socket);
+}
+
+void handle_server_msg(
+  const ServerMessageResumeToken& msg,
+  [[maybe_unused]]ip::udp::socket& gui_socket
+) {
+  println("Resume token received");
+  if (reconnect) { resume_token = msg.token; }
+}
+
+void handle_server_msg(
+  const ServerMessageStateHash& msg,
+  [[maybe_unused]]ip::udp::socket& gui_socket
+) {
+  auto ours = turn_hashes.find(msg.turn);
+  if (ours == turn_hashes.end()) {
+    expected_hashes[msg.turn] = msg.hash;
+    return;
+  }
+  check_state_hash(msg.turn, ours->second, msg.hash);
+}
+
+void handle_server_msg(
+  const ServerMessageResumed& msg,
+  ip::udp::socket& gui_socket
+) {
+  resuming = false;
+  if (msg.accepted) {
+    println("Resumed from turn:", sequencer.next_turn());
+    full_frame_due = true;
+    return;
+  }
+  // the game is over, or the server doesn't know us any more
+  println("Resume rejected");
+  if (pending_hello) { handle_server_msg(*pending_hello, gui_socket); }
+  pending_hello = std::nullopt;
+  reset_to_lobby(gui_socket);
+}
+
 ClientMessagePlaceBomb get_client_action(
   [[maybe_unused]]const InputMessagePlaceBomb& msg
 ) {
@@ -297,19 +702,17 @@ ClientMessageMove get_client_action(const InputMessageMove& msg) {
   return ClientMessageMove {msg.direction};
 }
 
-void handle_gui(ip::tcp::socket& server_socket, ip::udp::socket& gui_socket) {
+void handle_gui(ip::udp::socket& gui_socket) {
   std::vector<unsigned char> raw_buffer (MAX_UDP_MESSAGE_SIZE);
+  // decodes the datagrams in place and then encodes the answer, reusing its
+  // storage, so that no keypress allocates once the first one is through
+  streamable_buffer sbuffer;
 
   while (client_state != ClientState::Finish) {
-    streamable_buffer sbuffer;
-
     // receive the GUI message
     try {
       size_t received = gui_socket.receive(boost::asio::buffer(raw_buffer));
-      sbuffer = streamable_buffer {
-        raw_buffer.begin(),
-        raw_buffer.begin() + received
-      };
+      sbuffer.assign_view({raw_buffer.data(), received});
     } catch (const boost::system::system_error& e) {
       std::cerr << "UDP read failed\n";
       client_state = ClientState::Finish;
@@ -332,43 +735,169 @@ void handle_gui(ip::tcp::socket& server_socket, ip::udp::socket& gui_socket) {
       continue;
     }
 
-    // handle the message
-    ClientMessage response;
-    std::visit(
-      [&response](const auto& msg) {
-        if (client_state == ClientState::Lobby) {
-          response = ClientMessageJoin {player_name};
-        } else {
-          response = get_client_action(msg);
-        }
-      },
-      msg
-    );
-    sbuffer << response;
+    if (std::holds_alternative<InputMessageResync>(msg)) {
+      full_frame_due = true;
+      continue;
+    }
+
+    // handle the message; a join is encoded field by field so that the
+    // player's name isn't copied into a message first
+    bool over_udp = false;
+    if (client_state == ClientState::Lobby) {
+      sbuffer << ClientMessageJoin::msg_id << player_name;
+    } else {
+      over_udp = udp_open;
+      if (over_udp) { begin_datagram(sbuffer); }
+      std::visit(
+        [&sbuffer](const auto& msg) {
+          if constexpr (!std::is_same_v<std::decay_t<decltype(msg)>, InputMessageResync>) {
+            sbuffer << get_client_action(msg);
+          }
+        },
+        msg
+      );
+    }
+
+    if (over_udp) {
+      try {
+        send_datagram(sbuffer);
+      } catch (const boost::system::system_error& e) {
+        std::cerr << "UDP write failed\n";
+        sbuffer.clear();
+      }
+      continue;
+    }
 
     // pass the communicate to the server
     try {
-      send(sbuffer, server_socket);
+      send_to_server(sbuffer);
     } catch (const boost::system::system_error& e) {
       std::cerr << "TCP write failed\n";
+      // the reading side notices too, and resumes if it can
+      if (reconnect) {
+        sbuffer.clear();
+        continue;
+      }
       client_state = ClientState::Finish;
       return;
     }
   }
 }
 
-void handle_server(ip::tcp::socket& server_socket, ip::udp::socket& gui_socket) {
-  auto provider = [&server_socket] (size_t n) -> std::vector<uint8_t> {
-    return read(server_socket, n);
+// Ask over TCP for the turns which the datagrams didn't bring
+void request_lost_turns() {
+  std::optional<std::pair<turn_t, turn_t>> gap = sequencer.gap();
+  if (!gap) { return; }
+  println("Lost turns:", gap->first, gap->second);
+  streamable_buffer sbuffer;
+  sbuffer << ClientMessageResendTurns {
+    .first = gap->first,
+    .count = static_cast<turn_t>(gap->second - gap->first)
+  };
+  try {
+    send_to_server(sbuffer);
+  } catch (const boost::system::system_error& e) {
+    std::cerr << "TCP write failed\n";
+  }
+}
+
+void handle_turn_datagrams(ip::udp::socket& gui_socket) {
+  std::vector<unsigned char> raw_buffer (MAX_UDP_MESSAGE_SIZE);
+  streamable_buffer sbuffer;
+  sbuffer.set_limits(server_msg_limits);
+  std::vector<ServerMessageTurn> received_turns;
+
+  while (client_state != ClientState::Finish) {
+    try {
+      size_t received = game_socket->receive(boost::asio::buffer(raw_buffer));
+      sbuffer.assign_view({raw_buffer.data(), received});
+      // a whole datagram gets the budget of one message
+      sbuffer.begin_message();
+    } catch (const boost::system::system_error& e) {
+      // e.g. the server's port was briefly unreachable
+      continue;
+    }
+
+    std::scoped_lock lock {mutex_game};
+    sbuffer.set_format(server_format);
+    uint32_t epoch;
+    uint8_t count;
+    try {
+      sbuffer >> epoch >> count;
+      for (uint8_t i=0; i < count; ++i) {
+        ServerMessage msg;
+        sbuffer >> msg;
+        if (auto turn = std::get_if<ServerMessageTurn>(&msg)) {
+          received_turns.push_back(std::move(*turn));
+        }
+      }
+    } catch (const streamable_buffer::buffer_underflow& e) {
+      std::cerr << "Server: datagram incomplete\n";
+      received_turns.clear();
+      continue;
+    } catch (const invalid_message& e) {
+      std::cerr << "Server: datagram invalid\n";
+      received_turns.clear();
+      continue;
+    }
+
+    for (ServerMessageTurn& turn : received_turns) {
+      sequencer.offer_datagram(epoch, std::move(turn));
+    }
+    received_turns.clear();
+    apply_sequenced_turns(gui_socket);
+    request_lost_turns();
+  }
+}
+
+// Connects again and asks for our player back, retrying for a while; false
+// if the server couldn't be reached
+bool resume_session() {
+  std::chrono::milliseconds backoff {100};
+  for (int attempt = 0; attempt < 6; ++attempt, backoff *= 2) {
+    std::this_thread::sleep_for(backoff);
+    std::shared_ptr<connection> conn;
+    try {
+      conn = connect_server();
+    } catch (const std::exception& e) {
+      std::cerr << "Reconnecting failed: " << e.what() << std::endl;
+      continue;
+    }
+
+    std::scoped_lock lock {mutex_game};
+    streamable_buffer sbuffer;
+    sbuffer << ClientMessageResume {
+      .token = *resume_token,
+      .next_turn = sequencer.next_turn()
+    };
+    try {
+      send(sbuffer, *conn);
+    } catch (const boost::system::system_error& e) {
+      continue;
+    }
+    resuming = true;
+    std::scoped_lock lock_send {mutex_server_send};
+    server_conn = std::move(conn);
+    return true;
+  }
+  return false;
+}
+
+void handle_server(ip::udp::socket& gui_socket) {
+  std::shared_ptr<connection> server = server_conn;
+  auto provider = [&server] (std::span<unsigned char> out) {
+    server->read(out);
   };
 
   streamable_buffer sbuffer;
   sbuffer.set_provider(provider);
+  sbuffer.set_limits(server_msg_limits);
 
   while (client_state != ClientState::Finish) {
     ServerMessage msg;
 
     try {
+      sbuffer.begin_message();
       sbuffer >> msg;
     } catch (const invalid_message& e) {
       std::cerr << "Received invalid message from the server!" << std::endl;
@@ -376,16 +905,71 @@ void handle_server(ip::tcp::socket& server_socket, ip::udp::socket& gui_socket)
       std::exit(1);
     } catch (const boost::system::system_error& e) {
       std::cerr << "TCP read failed!" << std::endl;
+      bool resumable;
+      {
+        std::scoped_lock lock {mutex_game};
+        resumable = resume_token.has_value();
+      }
+      if (resumable && resume_session()) {
+        // the new connection starts over in the legacy encoding
+        std::scoped_lock lock {mutex_server_send};
+        server = server_conn;
+        sbuffer.clear();
+        sbuffer.set_format(wire_format::legacy);
+        continue;
+      }
       client_state = ClientState::Finish;
       std::exit(1);
     }
     sbuffer.clear();
 
+    std::scoped_lock lock {mutex_game};
+    // everything after the reply is encoded in the negotiated format
+    if (auto negotiated = std::get_if<ServerMessageNegotiated>(&msg)) {
+      if (negotiated->features & FEATURE_COMPACT) {
+        sbuffer.set_format(wire_format::compact);
+        server_format = wire_format::compact;
+      }
+    }
+
     std::visit(
-      [&gui_socket](auto&& x) { handle_server_msg(x, gui_socket); },
-      msg
+      [&gui_socket](auto&& x) { handle_server_msg(std::move(x), gui_socket); },
+      std::move(msg)
     );
+    if (udp_open) { request_lost_turns(); }
+  }
+}
+
+// Sets up the connection to the server once it's connected over TCP, and
+// opens the socket of the UDP channel if it is going to be asked for
+std::shared_ptr<connection> setup_tcp(std::shared_ptr<ip::tcp::socket> server_socket, boost::asio::io_service& io_service, features_t features) {
+  server_socket->set_option(ip::tcp::no_delay(true));
+  println("TCP connection bound to:", server_socket->remote_endpoint());
+
+  if ((features & FEATURE_UDP) && !game_socket) {
+    ip::tcp::endpoint server = server_socket->remote_endpoint();
+    game_socket.emplace(io_service);
+    game_socket->connect(ip::udp::endpoint {server.address(), server.port()});
   }
+
+  // as the server prints our address into Player, over IPv6 or not; a
+  // resumed player keeps the one of the first connection
+  if (!own_addresses.empty()) { return std::make_shared<asio_connection>(std::move(*server_socket)); }
+  ip::tcp::endpoint local = server_socket->local_endpoint();
+  std::stringstream ss;
+  ss << local;
+  own_addresses.push_back(ss.str());
+  if (local.address().is_v4()) {
+    ip::tcp::endpoint mapped {
+      ip::make_address_v6(ip::v4_mapped, local.address().to_v4()),
+      local.port()
+    };
+    ss.str("");
+    ss << mapped;
+    own_addresses.push_back(ss.str());
+  }
+
+  return std::make_shared<asio_connection>(std::move(*server_socket));
 }
 
 int main(int argc, char* argv[]) {
@@ -395,7 +979,41 @@ int main(int argc, char* argv[]) {
     ("gui-address,d",   po::value<std::string>()->required(), "GUI server address <hostname|IPv4|IPv6[:port]>")
     ("player-name,n",   po::value<std::string>()->required(), "player name")
     ("port,p",          po::value<port_t>()->required(), "port to listen to GUI messages")
-    ("server-address,s",po::value<std::string>()->required(), "game server address <hostname|IPv4|IPv6[:port]>")
+    ("server-address,s",po::value<std::string>()->required(), "game server address <hostname|IPv4|IPv6[:port]|shm:path>")
+    ("compact",         po::bool_switch(), "ask the server for the compact turn encoding")
+    (
+      "resolve-cache",
+      po::value<std::string>(),
+      "file in which clients on this host share the addresses they resolve"
+    )
+    (
+      "resolve-ttl",
+      po::value<unsigned>()->default_value(30),
+      "seconds for which resolved addresses are reused"
+    )
+    ("udp",             po::bool_switch(), "ask the server for the turns over UDP")
+    ("check-state",     po::bool_switch(), "ask the server for hashes of the game state, and report where ours differs")
+    ("reconnect",       po::bool_switch(), "if the connection breaks during a game, connect again and resume playing")
+    (
+      "udp-loss",
+      po::value<double>()->default_value(0),
+      "share of the input datagrams to drop, to test the UDP channel"
+    )
+    (
+      "gui-oversize",
+      po::value<oversize_policy>()->default_value(oversize_policy::clip),
+      "draw messages longer than a datagram: clip (to the cells around the robot) or, for GUIs that support it, fragment (into DrawMessageFragment)"
+    )
+    (
+      "gui-max-datagram",
+      po::value<size_t>()->default_value(MAX_UDP_MESSAGE_SIZE),
+      "longest datagram sent to the GUI"
+    )
+    (
+      "delta-frames",
+      po::value<game_length_t>()->default_value(0),
+      "send the GUI delta frames, with a full one every that many turns (0: full frames only)"
+    )
     ;
 
   po::variables_map vm;
@@ -422,40 +1040,124 @@ int main(int argc, char* argv[]) {
   const std::string gui_addr = vm["gui-address"].as<std::string>();
   const uint16_t gui_port = vm["port"].as<uint16_t>();
   player_name = vm["player-name"].as<std::string>();
+  std::optional<std::string> resolve_cache_path;
+  if (vm.count("resolve-cache")) { resolve_cache_path = vm["resolve-cache"].as<std::string>(); }
+  unsigned resolve_ttl = vm["resolve-ttl"].as<unsigned>();
+  features_t features = vm["compact"].as<bool>() ? FEATURE_COMPACT : 0;
+  if (vm["udp"].as<bool>()) { features |= FEATURE_UDP; }
+  if (vm["check-state"].as<bool>()) { features |= FEATURE_STATE_HASH; }
+  reconnect = vm["reconnect"].as<bool>();
+  if (reconnect) { features |= FEATURE_RESUME; }
+  double loss = vm["udp-loss"].as<double>();
+  if (loss < 0 || loss > 1) {
+    std::cerr << "The share of datagrams to drop should be 0-1" << std::endl;
+    return 1;
+  }
+  udp_loss.set_rate(loss);
+  delta_interval = vm["delta-frames"].as<game_length_t>();
+  oversize = vm["gui-oversize"].as<oversize_policy>();
+  max_gui_datagram = vm["gui-max-datagram"].as<size_t>();
+  if (max_gui_datagram < 64 || max_gui_datagram > MAX_UDP_MESSAGE_SIZE) {
+    std::cerr << "GUI datagrams should be 64-" << MAX_UDP_MESSAGE_SIZE << " bytes long" << std::endl;
+    return 1;
+  }
 
   boost::asio::io_service io_service;
-  ip::tcp::socket server_socket(io_service);
   ip::udp::socket gui_socket(
     io_service,
     ip::udp::endpoint {ip::udp::v6(), gui_port}
   );
 
+  resolution_cache cache {std::chrono::seconds {resolve_ttl}, resolve_cache_path};
   try {
-    auto server_endpoints = resolve_address<ip::tcp::resolver>(
-        server_addr,
-        io_service
-    );
-    gui_endpoints = resolve_address<ip::udp::resolver>(
-        gui_addr,
-        io_service
+    // the server and the GUI are resolved, and the server connected to,
+    // all at the same time
+    std::shared_ptr<ip::tcp::socket> server_socket;
+    if (server_addr.starts_with("shm:")) {
+#ifdef BOMBERMAN_HAS_SHM
+      if (features & FEATURE_UDP) {
+        std::cerr << "No UDP channel over shared memory" << std::endl;
+        features = static_cast<features_t>(features & ~FEATURE_UDP);
+      }
+      std::string address;
+      server_conn = shm_connect(server_addr.substr(4), address);
+      println("Shared memory connection bound to:", server_addr.substr(4));
+      own_addresses.push_back(address);
+#else
+      std::cerr << "Shared memory connections are not supported here" << std::endl;
+      return 1;
+#endif
+    } else {
+      server_socket = std::make_shared<ip::tcp::socket>(io_service);
+      async_resolve_address<ip::tcp::resolver>(server_addr, io_service, cache,
+        [&io_service, server_socket] (std::vector<ip::tcp::endpoint> endpoints) {
+          async_connect_racing(*server_socket, endpoints, io_service, [] {});
+        }
+      );
+    }
+    async_resolve_address<ip::udp::resolver>(gui_addr, io_service, cache,
+      [] (std::vector<ip::udp::endpoint> endpoints) { gui_endpoint = endpoints.front(); }
     );
+    io_service.run();
+    if (server_socket) {
+      server_conn = setup_tcp(server_socket, io_service, features);
+    }
 
-    boost::asio::connect(server_socket, server_endpoints);
-    server_socket.set_option(ip::tcp::no_delay(true));
-    println("TCP connection bound to:", server_socket.remote_endpoint());
+    // legacy servers would drop us for an unknown message, so only ask
+    // when some extension has actually been requested
+    if (features) {
+      streamable_buffer sbuffer;
+      sbuffer << ClientMessageNegotiate {.features = features};
+      send(sbuffer, *server_conn);
+    }
   } catch (const addr_resolution_error& e) {
     std::cerr << e.what() << std::endl;
     return 1;
   } catch (const boost::system::system_error& e) {
     std::cerr << e.what() << std::endl;
     return 1;
+  } catch (const std::system_error& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
   }
  
+  // the same as above, for the server only
+  connect_server = [&server_addr, &io_service, &cache, features] () -> std::shared_ptr<connection> {
+    std::shared_ptr<connection> conn;
+    if (server_addr.starts_with("shm:")) {
+#ifdef BOMBERMAN_HAS_SHM
+      std::string address;
+      conn = shm_connect(server_addr.substr(4), address);
+#endif
+    } else {
+      auto server_socket = std::make_shared<ip::tcp::socket>(io_service);
+      async_resolve_address<ip::tcp::resolver>(server_addr, io_service, cache,
+        [&io_service, server_socket] (std::vector<ip::tcp::endpoint> endpoints) {
+          async_connect_racing(*server_socket, endpoints, io_service, [] {});
+        }
+      );
+      io_service.restart();
+      io_service.run();
+      conn = setup_tcp(server_socket, io_service, features);
+    }
+    streamable_buffer sbuffer;
+    sbuffer << ClientMessageNegotiate {.features = features};
+    send(sbuffer, *conn);
+    return conn;
+  };
+
   std::thread gui_thread {
-    handle_gui, std::ref(server_socket), std::ref(gui_socket)
+    handle_gui, std::ref(gui_socket)
   };
-  handle_server(server_socket, gui_socket);
+  std::thread datagram_thread;
+  if (game_socket) {
+    datagram_thread = std::thread {
+      handle_turn_datagrams, std::ref(gui_socket)
+    };
+  }
+  handle_server(gui_socket);
   gui_thread.join();
+  if (datagram_thread.joinable()) { datagram_thread.join(); }
   
   return 0;
 }
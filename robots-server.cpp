@@ -1,19 +1,42 @@
+#include <array>
 #include <chrono>
+#include <deque>
 #include <iostream>
 #include <functional>
+#include <future>
 #include <random>
+#include <ranges>
 #include <thread>
 
 #include <boost/asio.hpp>
 #include <boost/numeric/conversion/cast.hpp>
 #include <boost/program_options.hpp>
 
+#include "board-generator.hpp"
 #include "common.hpp"
+#include "connection.hpp"
 #include "debug.hpp"
+#include "interest-index.hpp"
+#include "lock-profiler.hpp"
 #include "messages.hpp"
+#include "player-table.hpp"
 #include "streamable-buffer.hpp"
 #include "serialization.hpp"
 #include "safe-queue.hpp"
+#include "state-hash.hpp"
+#include "token-bucket.hpp"
+#include "udp-channel.hpp"
+#include "work-stealing-pool.hpp"
+
+#if __has_include(<linux/io_uring.h>)
+#define BOMBERMAN_HAS_IO_URING
+#include "io-uring-backend.hpp"
+#endif
+
+#if __has_include(<sys/eventfd.h>)
+#define BOMBERMAN_HAS_SHM
+#include "shm-transport.hpp"
+#endif
 
 namespace po = boost::program_options;
 
@@ -37,6 +60,23 @@ struct ServerParams {
   server_name_t server_name;
   pos_t size_x;
   pos_t size_y;
+  // 0 if every client gets all the events
+  pos_t interest_radius;
+  // 0 if the turns are resolved on the game thread alone
+  unsigned turn_workers;
+  // whether clients may get the turns over UDP, and the share of the turn
+  // datagrams dropped on purpose, for testing
+  bool udp;
+  double udp_loss;
+  // clients which ask for it get the hash of the state every that many
+  // turns; 0 if never
+  game_length_t hash_interval;
+  // messages per second a client may send on average, and at once (rate 0:
+  // unlimited); clients are disconnected once that many of their messages
+  // have been dropped over it (0: never)
+  double msg_rate;
+  double msg_burst;
+  uint64_t msg_drop_limit;
 };
 
 class Server {
@@ -44,43 +84,101 @@ class Server {
   static constexpr size_t max_clients = 25;
   // max 100 unreceived messages
   static constexpr size_t max_queue_size = 100;
+  // the game thread waits once it gets that many broadcasts ahead
+  static constexpr size_t max_pending_broadcasts = 16;
+  // the longest client message is a join with a name of maximal length
+  static constexpr streamable_buffer::decode_limits client_msg_limits {
+    .max_bytes = sizeof(msg_id_t) + sizeof(strlen_t) + std::numeric_limits<strlen_t>::max(),
+    .max_elements = std::numeric_limits<strlen_t>::max()
+  };
   const ServerParams params;
+  const features_t supported_features;
   const port_t port;
   std::minstd_rand random;
+  const std::unique_ptr<network_backend> backend;
+  // where clients on this host may connect over shared memory, if anywhere
+  const std::optional<std::string> shm_path;
 
   struct ClientInfo {
-    std::shared_ptr<tcp::socket> sock;
+    std::shared_ptr<connection> conn;
     ClientMessage last_msg;
     std::optional<player_id_t> player_id;
+    wire_format format = wire_format::legacy;
+    // the UDP channel, if granted: the token of the client's datagrams, the
+    // sequence number of the last one, and where the turns go, once known
+    std::optional<uint32_t> udp_token;
+    uint32_t udp_sequence = 0;
+    std::optional<udp::endpoint> udp_endpoint;
+    token_bucket datagram_budget;
+    // whether it gets a token to resume its player with
+    bool resumable = false;
+    bool state_hashes = false;
   };
 
   std::map<tcp::endpoint, ClientInfo> clients;
-  std::mutex mutex_clients;
+  profiled_mutex mutex_clients {"mutex_clients"};
+  // one per wire_format, reused between broadcasts; guarded by mutex_clients
+  std::array<streamable_buffer, wire_format_count> broadcast_buffers;
+  std::array<streamable_buffer, wire_format_count> datagram_buffers;
+  // how many turns of the game are going out to the clients; a resumed
+  // client gets the ones it missed up to there, and the broadcaster the rest
+  size_t turns_broadcast = 0;
+  // of the UDP channel and of resumes
+  std::random_device tokens;
+
+  // open only if the UDP channel is enabled
+  boost::asio::io_service udp_io;
+  std::optional<udp::socket> udp_socket;
+  loss_injector udp_loss;
 
   struct PlayerInfo {
     std::string name;
     Position pos;
     ClientMessage msg;
     Player player;
+    uint64_t resume_token;
 
-    friend std::ostream& operator<<(std::ostream& os, PlayerInfo x) {
+    friend std::ostream& operator<<(std::ostream& os, const PlayerInfo& x) {
       return os << x.name << x.pos;
     }
   };
 
-  std::condition_variable cond_players;
-  std::mutex mutex_players;
-  std::map<player_id_t, PlayerInfo> players;
+  std::condition_variable_any cond_players;
+  profiled_mutex mutex_players {"mutex_players"};
+  player_table<PlayerInfo> players;
   
   enum class State { Lobby, Maintenance, Playing };
   std::atomic<State> state;
 
-  boost::asio::io_service io_service;
-
-  std::vector<ServerMessageTurn> turns;
-  std::mutex mutex_turns;
+  // frozen once resolved, so the broadcaster reads them without a lock
+  std::vector<std::shared_ptr<const ServerMessageTurn>> turns;
+  profiled_mutex mutex_turns {"mutex_turns"};
 
   std::vector<Event> turn_events;
+  // of the state after turn_events; kept by the game thread along with them
+  state_hash hash;
+  // the number of the game, which tags its turn datagrams
+  uint32_t epoch = 0;
+
+  // what every player's input of the turn leads to, in the order of players;
+  // guarded by mutex_turns and mutex_players
+  struct Intent {
+    player_id_t player_id;
+    const PlayerInfo* player;
+    std::optional<Event> event;
+  };
+  std::vector<Intent> intents;
+  work_stealing_pool turn_pool;
+
+  // set only in the interest management mode; used by the broadcaster only
+  std::optional<interest_index> interest;
+  std::vector<uint32_t> interesting_events;
+  streamable_buffer interest_buffer;
+
+  // the last turns of the game, repeated in its datagrams; used by the
+  // broadcaster only
+  std::deque<std::shared_ptr<const ServerMessageTurn>> recent_turns;
+  uint32_t recent_epoch = 0;
   
   const ServerMessageHello hello = ServerMessageHello {
     .server_name      = params.server_name,
@@ -91,25 +189,43 @@ class Server {
     .explosion_radius = params.explosion_radius,
     .bomb_timer       = params.bomb_timer
   };
-
-  void client_connected(std::shared_ptr<tcp::socket> sock) {
-    ip::tcp::endpoint client_endpoint = sock->remote_endpoint();
+  // every client gets it first thing, so it's encoded once
+  const std::vector<unsigned char> encoded_hello = [this] {
+    streamable_buffer sbuffer;
+    sbuffer << hello;
+    std::span<const unsigned char> data = sbuffer.data();
+    return std::vector<unsigned char>(data.begin(), data.end());
+  }();
+
+  // The sessions are served by a fixed set of threads, one for every client
+  // there may be, started along with the server; an accepted connection only
+  // waits in the queue for a free one. Connections beyond max_clients are
+  // turned away.
+  safe_queue<std::shared_ptr<connection>> pending_sessions {max_clients};
+  std::atomic<size_t> sessions = 0;
+
+  // messages dropped over the rate limit, and clients disconnected for it,
+  // during the current game
+  std::atomic<uint64_t> messages_dropped = 0;
+  std::atomic<uint64_t> clients_cut_off = 0;
+
+  void client_connected(std::shared_ptr<connection> conn) {
+    ip::tcp::endpoint client_endpoint = conn->remote_endpoint();
     println("Connected:", client_endpoint);
 
-    std::scoped_lock lock {mutex_clients};
-    assert(clients.size() < max_clients);
-    clients[client_endpoint].sock = sock;
+    profiled_lock lock {mutex_clients};
+    ClientInfo& client = clients[client_endpoint];
+    client.conn = conn;
+    client.datagram_budget = token_bucket {params.msg_rate, params.msg_burst};
   }
 
   void client_disconnected(ip::tcp::endpoint client_endpoint) {
     println("Disconnected:", client_endpoint);
     {
-      std::scoped_lock lock {mutex_clients};
+      profiled_lock lock {mutex_clients};
       auto it = clients.find(client_endpoint);
       assert(it != clients.end());
-      try {
-        it->second.sock->shutdown(boost::asio::ip::tcp::socket::shutdown_both);
-      } catch (const boost::system::system_error& e) {}
+      it->second.conn->shutdown();
       clients.erase(it);
     }
 
@@ -123,7 +239,7 @@ class Server {
   }
 
   void await_players() {
-    std::unique_lock lock {mutex_players};
+    profiled_lock lock {mutex_players};
     cond_players.wait(lock,
       [this] { return players.size() == params.players_count; }
     );
@@ -131,67 +247,235 @@ class Server {
 
   void init_game() {
     println("Generating new board...");
-    std::scoped_lock lock {mutex_players};
+    ++epoch;
+    profiled_lock lock {mutex_players};
     
-    for (auto& [player_id, player] : players) {
-      player.pos = {
-        .x = static_cast<pos_t>(random() % params.size_x),
-        .y = static_cast<pos_t>(random() % params.size_y)
-      };
+    board_t board = generate_board(
+      random,
+      params.size_x,
+      params.size_y,
+      players.size(),
+      params.initial_blocks
+    );
+    turn_events.reserve(turn_events.size() + board.spawns.size() + board.blocks.size());
+
+    hash.clear();
+    auto spawn = board.spawns.begin();
+    for (auto&& [player_id, player] : players) {
+      player.pos = *spawn++;
       turn_events.push_back(EventPlayerMoved {.player_id = player_id, .position = player.pos});
+      hash.toggle_robot(player_id, player.pos);
     }
 
-    for (size_t i=0; i < params.initial_blocks; ++i) {
-      Position pos = {
-        .x = static_cast<pos_t>(random() % params.size_x),
-        .y = static_cast<pos_t>(random() % params.size_y)
-      };
+    for (const Position& pos : board.blocks) {
       turn_events.push_back(EventBlockPlaced {.position = pos});
+      hash.toggle_block(pos);
     }
 
     cond_players.notify_one();
   }
 
-  void broadcast_message(ServerMessage&& msg) {
-    std::scoped_lock lock {mutex_clients};
-    streamable_buffer sbuffer;
+  void send_to(ClientInfo& client, std::span<const unsigned char> data) {
+    try {
+      client.conn->send(data);
+    } catch (const boost::system::system_error& e) {
+      println("Error writing to client!");
+    }
+  }
+
+  // Encoded once per wire format in use, not per client. The clients for
+  // which `skip` returns true are left out.
+  template <typename Message, typename Skip>
+  void broadcast_message(const Message& msg, Skip skip) {
+    profiled_lock lock {mutex_clients};
+    send_batch batch {*backend};
     for (auto& [key, client] : clients) {
-      sbuffer << msg;
+      if (skip(client)) { continue; }
+      streamable_buffer& sbuffer = broadcast_buffers[static_cast<size_t>(client.format)];
+      if (sbuffer.empty()) {
+        sbuffer.set_format(client.format);
+        sbuffer << msg;
+      }
+      send_to(client, sbuffer.data());
+    }
+    for (streamable_buffer& sbuffer : broadcast_buffers) { sbuffer.clear(); }
+  }
+
+  template <typename Message>
+  void broadcast_message(const Message& msg) {
+    broadcast_message(msg, [] (const ClientInfo&) { return false; });
+  }
+
+  // Spectators get the whole turn; every player only the events within the
+  // interest radius of their robot.
+  void broadcast_local_turn(const ServerMessageTurn& msg, const std::map<player_id_t, Position>& robots) {
+    interest->build(msg.events);
+    auto located = [&robots] (const ClientInfo& client) {
+      return client.player_id && robots.contains(*client.player_id);
+    };
+    broadcast_message(msg, located);
+
+    profiled_lock lock {mutex_clients};
+    for (auto& [key, client] : clients) {
+      if (!located(client)) { continue; }
+      interest->select(robots.at(*client.player_id), interesting_events);
+      auto events = interesting_events | std::views::transform(
+        [&msg] (uint32_t i) -> const Event& { return msg.events[i]; }
+      );
+      interest_buffer.set_format(client.format);
+      encode_turn(interest_buffer, msg.turn, events);
+      send_to(client, interest_buffer.data());
+      interest_buffer.clear();
+    }
+  }
+
+  // The datagram of the turn for the clients of a wire format: the turn and
+  // as many of the ones before it as fit. Left empty if the turn alone
+  // doesn't fit.
+  void encode_turns_datagram(streamable_buffer& sbuffer, wire_format format, uint32_t turns_epoch) {
+    sbuffer.set_format(format);
+    for (size_t count = recent_turns.size(); count > 0; --count) {
+      sbuffer.clear();
+      sbuffer << turns_epoch << static_cast<uint8_t>(count);
+      for (size_t i = recent_turns.size() - count; i < recent_turns.size(); ++i) {
+        sbuffer << *recent_turns[i];
+      }
+      if (sbuffer.size() <= MAX_UDP_MESSAGE_SIZE) { return; }
+    }
+    sbuffer.clear();
+  }
+
+  // The turn goes over UDP to the clients whose datagrams have arrived, and
+  // over TCP if it doesn't fit in a datagram
+  void broadcast_datagrams(uint32_t turn_epoch, const std::shared_ptr<const ServerMessageTurn>& msg) {
+    if (!udp_socket) { return; }
+    if (turn_epoch != recent_epoch) {
+      recent_turns.clear();
+      recent_epoch = turn_epoch;
+    }
+    recent_turns.push_back(msg);
+    if (recent_turns.size() > udp_redundant_turns) { recent_turns.pop_front(); }
+
+    std::array<bool, wire_format_count> encoded {};
+    profiled_lock lock {mutex_clients};
+    for (auto& [key, client] : clients) {
+      if (!client.udp_endpoint) { continue; }
+      size_t format = static_cast<size_t>(client.format);
+      streamable_buffer& sbuffer = datagram_buffers[format];
+      if (!encoded[format]) {
+        encode_turns_datagram(sbuffer, client.format, turn_epoch);
+        encoded[format] = true;
+      }
+      if (sbuffer.empty()) {
+        streamable_buffer& stream = broadcast_buffers[format];
+        if (stream.empty()) {
+          stream.set_format(client.format);
+          stream << *msg;
+        }
+        send_to(client, stream.data());
+        continue;
+      }
+      if (udp_loss.drop_next()) { continue; }
       try {
-        send(sbuffer, *client.sock);
+        std::span<const unsigned char> data = sbuffer.data();
+        udp_socket->send_to(boost::asio::buffer(data.data(), data.size()), *client.udp_endpoint);
       } catch (const boost::system::system_error& e) {
         println("Error writing to client!");
       }
-      assert(sbuffer.empty());
     }
+    for (streamable_buffer& sbuffer : datagram_buffers) { sbuffer.clear(); }
+    for (streamable_buffer& sbuffer : broadcast_buffers) { sbuffer.clear(); }
+  }
+
+  // The encode and send stage of the game loop, run on its own thread so
+  // that the game thread can collect the inputs of the next turn meanwhile.
+  // Everything the game loop broadcasts goes through it, in order.
+  safe_queue<std::function<void()>> broadcasts {max_pending_broadcasts};
+
+  void broadcast_in_order(std::function<void()> job) {
+    broadcasts.push_wait(std::move(job));
   }
 
+  // Wait until everything queued so far has been sent
+  void await_broadcasts() {
+    std::promise<void> done;
+    broadcast_in_order([&done] { done.set_value(); });
+    done.get_future().wait();
+  }
+
+  void run_broadcasts() {
+    while (true) {
+      broadcasts.pop()();
+    }
+  }
+
+  // Freeze the state of the turn and hand it over to the broadcaster
   void broadcast_turn(turn_t turn) {
-    println("Broadcasting current state for turn:", turn);
-    std::scoped_lock lock {mutex_turns};
-    auto msg = ServerMessageTurn {
-      .turn = turn,
-      .events = turn_events
-    };
-    turns.push_back(msg);
-    broadcast_message(msg);
-    turn_events.clear();
+    std::map<player_id_t, Position> robots;
+    if (interest) {
+      profiled_lock lock {mutex_players};
+      for (const auto& [player_id, player] : players) { robots[player_id] = player.pos; }
+    }
+
+    std::shared_ptr<const ServerMessageTurn> msg;
+    {
+      profiled_lock lock {mutex_turns};
+      msg = std::make_shared<const ServerMessageTurn>(ServerMessageTurn {
+        .turn = turn,
+        .events = std::move(turn_events)
+      });
+      turn_events.clear();
+      turns.push_back(msg);
+    }
+
+    broadcast_in_order([this, msg, robots = std::move(robots), turn_epoch = epoch, turn_hash = hash.get()] {
+      println("Broadcasting current state for turn:", msg->turn);
+      {
+        // a client resuming from now on gets this turn twice rather than never
+        profiled_lock lock {mutex_clients};
+        turns_broadcast = msg->turn + 1;
+      }
+      send_batch batch {*backend};
+      if (interest) {
+        broadcast_local_turn(*msg, robots);
+      } else {
+        broadcast_message(*msg, [] (const ClientInfo& client) { return client.udp_endpoint.has_value(); });
+        broadcast_datagrams(turn_epoch, msg);
+      }
+      if (params.hash_interval > 0 && msg->turn % params.hash_interval == 0) {
+        broadcast_message(
+          ServerMessageStateHash {.turn = msg->turn, .hash = turn_hash},
+          [] (const ClientInfo& client) { return !client.state_hashes; }
+        );
+      }
+    });
   }
 
-  std::optional<Event> get_event([[maybe_unused]]player_id_t player_id, [[maybe_unused]]ClientMessageJoin msg) {
+  std::optional<Event> get_event([[maybe_unused]]const PlayerInfo& player, [[maybe_unused]]player_id_t player_id, [[maybe_unused]]const ClientMessageJoin& msg) const {
     return {};
   }
 
-  std::optional<Event> get_event([[maybe_unused]]player_id_t player_id, [[maybe_unused]]ClientMessagePlaceBlock msg) {
+  std::optional<Event> get_event([[maybe_unused]]const PlayerInfo& player, [[maybe_unused]]player_id_t player_id, [[maybe_unused]]const ClientMessagePlaceBlock& msg) const {
     return {};
   }
 
-  std::optional<Event> get_event([[maybe_unused]]player_id_t player_id, [[maybe_unused]]ClientMessagePlaceBomb msg) {
+  std::optional<Event> get_event([[maybe_unused]]const PlayerInfo& player, [[maybe_unused]]player_id_t player_id, [[maybe_unused]]const ClientMessagePlaceBomb& msg) const {
     return {};
   }
 
-  std::optional<Event> get_event([[maybe_unused]]player_id_t player_id, [[maybe_unused]]ClientMessageMove msg) {
-    PlayerInfo& player = players[player_id];
+  std::optional<Event> get_event([[maybe_unused]]const PlayerInfo& player, [[maybe_unused]]player_id_t player_id, [[maybe_unused]]const ClientMessageNegotiate& msg) const {
+    return {};
+  }
+
+  std::optional<Event> get_event([[maybe_unused]]const PlayerInfo& player, [[maybe_unused]]player_id_t player_id, [[maybe_unused]]const ClientMessageResendTurns& msg) const {
+    return {};
+  }
+
+  std::optional<Event> get_event([[maybe_unused]]const PlayerInfo& player, [[maybe_unused]]player_id_t player_id, [[maybe_unused]]const ClientMessageResume& msg) const {
+    return {};
+  }
+
+  std::optional<Event> get_event(const PlayerInfo& player, player_id_t player_id, const ClientMessageMove& msg) const {
     Position new_pos = player.pos;
     if (player.pos.x > 0 && msg.direction == 3) { new_pos.x--; }
     else if (player.pos.x < params.size_x - 1 && msg.direction == 1) { new_pos.x++; }
@@ -201,70 +485,103 @@ class Server {
     return EventPlayerMoved { .player_id = player_id, .position = new_pos };
   }
 
+  // The intents only read the state of the previous turn, so they are
+  // computed in parallel; they are then merged in the order of players, which
+  // gives the same events as resolving the players one by one.
   void apply_player_moves() {
-    std::scoped_lock lock {mutex_turns, mutex_players};
-    for (auto elt : players) {
-      player_id_t player_id = elt.first;
-      PlayerInfo& player = elt.second;
-      ClientMessage msg = player.msg;
-      std::optional<Event> event = std::visit(
-        [this, player_id] (auto x) { return get_event(player_id, x); },
-        msg
+    profiled_lock lock {mutex_turns, mutex_players};
+    intents.clear();
+    for (const auto& [player_id, player] : players) {
+      intents.push_back(Intent {.player_id = player_id, .player = &player, .event = std::nullopt});
+    }
+
+    turn_pool.parallel_for(intents.size(), [this] (size_t i) {
+      Intent& intent = intents[i];
+      intent.event = std::visit(
+        [this, &intent] (const auto& x) { return get_event(*intent.player, intent.player_id, x); },
+        intent.player->msg
       );
-      if (event) { turn_events.push_back(*event); }
+    });
+
+    for (Intent& intent : intents) {
+      if (!intent.event) { continue; }
+      if (auto moved = std::get_if<EventPlayerMoved>(&*intent.event)) {
+        Position& pos = players.at(intent.player_id).pos;
+        hash.move_robot(intent.player_id, pos, moved->position);
+        pos = moved->position;
+      }
+      turn_events.push_back(std::move(*intent.event));
     }
   }
 
   void finish_game() {
+    // the last turns still go out to the clients as players
+    await_broadcasts();
     println("Cleaning up...");
     {
-      std::scoped_lock lock {mutex_clients};
+      // no resend may bring them after the end of the game
+      profiled_lock lock {mutex_turns};
+      turns.clear();
+    }
+    {
+      profiled_lock lock {mutex_clients};
       for (auto& [_, client] : clients) {
         client.player_id = std::nullopt;
       }
     }
     {
-      std::scoped_lock lock {mutex_players};
-      players = {};
+      profiled_lock lock {mutex_players};
+      players.clear();
       cond_players.notify_one();
     }
 
-    broadcast_message(ServerMessageGameEnded {});
-    println("Broadcasting GameEnded finished!");
+    broadcast_in_order([this] {
+      if (interest) { interest->clear(); }
+      // no later datagrams make up for the ones of the last turns
+      for (const auto& turn : recent_turns) {
+        broadcast_message(*turn, [] (const ClientInfo& client) { return !client.udp_endpoint; });
+      }
+      recent_turns.clear();
+      broadcast_message(ServerMessageGameEnded {});
+      profiled_lock lock {mutex_clients};
+      turns_broadcast = 0;
+      println("Broadcasting GameEnded finished!");
+    });
+    // the lobby's messages must not overtake the end of the game
+    await_broadcasts();
   }
 
+  // Replayed by the broadcaster between two of its jobs, when the turns
+  // below turns_broadcast are all out and the queued ones are still to come,
+  // so that the replay neither repeats nor interleaves with the broadcasts
   void send_past_turns(tcp::endpoint client_endpoint) {
-    auto it = clients.find(client_endpoint);
-    assert(it != clients.end());
-    ClientInfo& client = it->second;
+    broadcast_in_order([this, client_endpoint] {
+      profiled_lock lock {mutex_clients, mutex_turns};
+      auto it = clients.find(client_endpoint);
+      if (it == clients.end()) { return; }
+      ClientInfo& client = it->second;
 
-    streamable_buffer sbuffer;
-    for (ServerMessageTurn turn : turns) {
-      sbuffer << turn; 
-      try {
-        send(sbuffer, *client.sock);
-      } catch (const boost::system::system_error& e) {
-        println("Error writing to client!");
-      }
-      assert(sbuffer.empty());
-    }
+      streamable_buffer sbuffer;
+      sbuffer.set_format(client.format);
+      for (size_t i=0; i < std::min(turns_broadcast, turns.size()); ++i) { sbuffer << *turns[i]; }
+      send_to(client, sbuffer.data());
+    });
   }
 
   void send_players(tcp::endpoint client_endpoint) {
-    std::scoped_lock lock {mutex_players};
+    profiled_lock lock {mutex_players};
     streamable_buffer sbuffer;
-    for (auto [player_id, player] : players) {
-      sbuffer << ServerMessageAcceptedPlayer {
-        .player_id = player_id,
-        .player = player.player
-      };
+    for (const auto& [player_id, player] : players) {
+      // the layout of ServerMessageAcceptedPlayer, without copying the player
+      sbuffer << ServerMessageAcceptedPlayer::msg_id << player_id << player.player;
       try {
         auto it = clients.find(client_endpoint);
         assert(it != clients.end());
         ClientInfo& client = it->second;
-        send(sbuffer, *client.sock);
+        send(sbuffer, *client.conn);
       } catch (const boost::system::system_error& e) {
         println("Error writing to client!");
+        return;
       }
       assert(sbuffer.empty());
     }
@@ -277,17 +594,19 @@ class Server {
       send_past_turns(client_endpoint);
       return;
     }
+    uint64_t resume_token;
     {
-      std::scoped_lock lock {mutex_clients};
+      profiled_lock lock {mutex_clients};
       auto it = clients.find(client_endpoint);
       if (it == clients.end()) { return; }
       if (it->second.player_id) { return; }
+      resume_token = static_cast<uint64_t>(tokens()) << 32 | tokens();
     }
 
     player_id_t player_id;
     Player player;
     {
-      std::scoped_lock lock {mutex_players};
+      profiled_lock lock {mutex_players};
       player_id = static_cast<player_id_t>(players.size());
       std::stringstream ss;
       ss << client_endpoint;
@@ -295,19 +614,20 @@ class Server {
 
       player = Player { .name = msg.name, .address = addr };
 
-      auto [_, inserted] = players.insert({
+      bool inserted = players.insert(
         player_id,
         PlayerInfo {
           .name = msg.name,
           .pos = {},
           .msg = {},
-          .player = player
+          .player = player,
+          .resume_token = resume_token
         }
-      });
+      );
       if (!inserted) { return; }
     }
     {
-      std::scoped_lock lock {mutex_clients};
+      profiled_lock lock {mutex_clients};
       clients[client_endpoint].player_id = player_id;
     }
     cond_players.notify_one();
@@ -320,11 +640,54 @@ class Server {
         .player = player
       }
     );
+    {
+      profiled_lock lock {mutex_clients};
+      auto it = clients.find(client_endpoint);
+      if (it != clients.end() && it->second.resumable) {
+        streamable_buffer sbuffer;
+        sbuffer << ServerMessageResumeToken {.token = resume_token};
+        send_to(it->second, sbuffer.data());
+      }
+    }
     println("Current players:", players);
   }
 
+  void handle_client_msg(tcp::endpoint client_endpoint, const ClientMessageResume& msg) {
+    println("Client resumes from turn:", msg.next_turn);
+    profiled_lock lock {mutex_clients, mutex_players, mutex_turns};
+    auto it = clients.find(client_endpoint);
+    if (it == clients.end() || it->second.player_id) { return; }
+    ClientInfo& client = it->second;
+
+    std::optional<player_id_t> player_id;
+    for (const auto& [id, player] : players) {
+      if (player.resume_token == msg.token) { player_id = id; }
+    }
+    // the game is ending, and the turns it missed are gone already
+    if (turns.size() < turns_broadcast) { player_id = std::nullopt; }
+
+    streamable_buffer sbuffer;
+    sbuffer.set_format(client.format);
+    sbuffer << ServerMessageResumed {.accepted = player_id.has_value()};
+    if (player_id) {
+      // the connection it replaces may not have been noticed to be gone yet
+      for (auto& [key, other] : clients) {
+        if (other.player_id == player_id) {
+          other.player_id = std::nullopt;
+          other.conn->shutdown();
+        }
+      }
+      client.player_id = player_id;
+      for (const auto& turn : turns) {
+        if (turn->turn >= msg.next_turn && turn->turn < turns_broadcast) { sbuffer << *turn; }
+      }
+      println("Client resumes player:", +*player_id);
+    }
+    send_to(client, sbuffer.data());
+  }
+
   std::optional<player_id_t> get_player_id(tcp::endpoint client_endpoint) {
-    std::scoped_lock lock {mutex_clients};
+    profiled_lock lock {mutex_clients};
     return clients[client_endpoint].player_id;
   }
 
@@ -332,7 +695,7 @@ class Server {
     if (state != State::Playing) { return; }
     auto player_id = get_player_id(client_endpoint);
     if (!player_id) { return; };
-    std::scoped_lock lock {mutex_players};
+    profiled_lock lock {mutex_players};
     players[*player_id].msg = msg;
   }
 
@@ -351,30 +714,183 @@ class Server {
     set_input(client_endpoint, msg);
   }
 
+  void handle_client_msg(tcp::endpoint client_endpoint, const ClientMessageNegotiate& msg) {
+    println("Client negotiates features:", msg.features);
+    features_t granted = msg.features & supported_features;
+
+    // holding the lock makes the reply and the format switch atomic with
+    // respect to broadcasts, so the client sees the change exactly after it
+    profiled_lock lock {mutex_clients};
+    auto it = clients.find(client_endpoint);
+    if (it == clients.end()) { return; }
+    ClientInfo& client = it->second;
+
+    streamable_buffer sbuffer;
+    sbuffer << ServerMessageNegotiated {.features = granted};
+    if (granted & FEATURE_UDP) {
+      client.udp_token = static_cast<uint32_t>(tokens());
+      sbuffer << ServerMessageChannel {.token = *client.udp_token};
+    }
+    try {
+      send(sbuffer, *client.conn);
+    } catch (const boost::system::system_error& e) {
+      println("Error writing to client!");
+    }
+    if (granted & FEATURE_COMPACT) { client.format = wire_format::compact; }
+    if (granted & FEATURE_RESUME) { client.resumable = true; }
+    if (granted & FEATURE_STATE_HASH) { client.state_hashes = true; }
+  }
+
+  void handle_client_msg(tcp::endpoint client_endpoint, const ClientMessageResendTurns& msg) {
+    println("Client asks for turns:", msg.first, msg.count);
+    // sent under the lock, so that the turns can't overtake the end of their
+    // game, which clears them
+    profiled_lock lock {mutex_clients, mutex_turns};
+    auto it = clients.find(client_endpoint);
+    if (it == clients.end() || !it->second.udp_token) { return; }
+    ClientInfo& client = it->second;
+
+    streamable_buffer sbuffer;
+    sbuffer.set_format(client.format);
+    for (const auto& turn : turns) {
+      if (turn->turn >= msg.first && turn->turn - msg.first < msg.count) {
+        sbuffer << *turn;
+      }
+    }
+    send_to(client, sbuffer.data());
+  }
+
+  // The client whose datagram it is, unless an input sent after it has
+  // already arrived; the first datagram tells where to send the turns
+  std::optional<tcp::endpoint> accept_datagram(const udp::endpoint& sender, uint32_t token, uint32_t sequence, bool input) {
+    profiled_lock lock {mutex_clients};
+    for (auto& [key, client] : clients) {
+      if (client.udp_token != token) { continue; }
+      if (client.udp_endpoint && sequence <= client.udp_sequence) { return std::nullopt; }
+      client.udp_sequence = sequence;
+      client.udp_endpoint = sender;
+      if (input && !client.datagram_budget.take()) {
+        ++messages_dropped;
+        return std::nullopt;
+      }
+      return key;
+    }
+    return std::nullopt;
+  }
+
+  void receive_datagrams() {
+    std::vector<unsigned char> raw_buffer (MAX_UDP_MESSAGE_SIZE);
+    streamable_buffer sbuffer;
+    sbuffer.set_limits(client_msg_limits);
+
+    while (true) {
+      udp::endpoint sender;
+      try {
+        size_t received = udp_socket->receive_from(boost::asio::buffer(raw_buffer), sender);
+        sbuffer.assign_view({raw_buffer.data(), received});
+        sbuffer.begin_message();
+      } catch (const boost::system::system_error& e) {
+        continue;
+      }
+
+      uint32_t token;
+      uint32_t sequence;
+      std::optional<ClientMessage> msg;
+      try {
+        sbuffer >> token >> sequence;
+        if (!sbuffer.empty()) {
+          sbuffer >> msg.emplace();
+        }
+      } catch (const streamable_buffer::buffer_underflow& e) {
+        continue;
+      } catch (const invalid_message& e) {
+        continue;
+      }
+
+      std::optional<tcp::endpoint> client_endpoint = accept_datagram(sender, token, sequence, msg.has_value());
+      if (!client_endpoint || !msg) { continue; }
+
+      // only the inputs may come over UDP
+      if (auto move = std::get_if<ClientMessageMove>(&*msg)) {
+        if (move->direction <= 3) { set_input(*client_endpoint, *msg); }
+      } else if (std::holds_alternative<ClientMessagePlaceBomb>(*msg)
+                 || std::holds_alternative<ClientMessagePlaceBlock>(*msg)) {
+        set_input(*client_endpoint, *msg);
+      }
+    }
+  }
+
 public:
-  Server(ServerParams params, port_t port, seed_t seed)
+  Server(ServerParams params, port_t port, seed_t seed, std::unique_ptr<network_backend> backend, std::optional<std::string> shm_path)
     : params(params),
+      supported_features(static_cast<features_t>(
+        FEATURE_COMPACT | FEATURE_RESUME
+        | (params.udp && params.interest_radius == 0 ? FEATURE_UDP : 0)
+        // players with only the events around them don't see the whole state
+        | (params.hash_interval > 0 && params.interest_radius == 0 ? FEATURE_STATE_HASH : 0)
+      )),
       port(port),
-      random(seed)
-    {}
+      random(seed),
+      backend(std::move(backend)),
+      shm_path(std::move(shm_path)),
+      udp_loss(params.udp_loss),
+      turn_pool(params.turn_workers)
+    {
+      if (params.interest_radius > 0) { interest.emplace(params.interest_radius); }
+    }
 
-  void accept_clients() {
-    tcp::acceptor a (io_service, tcp::endpoint(tcp::v6(), port));
+  void accept_client(std::shared_ptr<connection> conn) {
+    size_t admitted = sessions;
+    do {
+      if (admitted == max_clients) {
+        // before the Hello, so that the client sees the server as gone
+        println("Server full, rejected:", conn->remote_endpoint());
+        conn->shutdown();
+        return;
+      }
+    } while (!sessions.compare_exchange_weak(admitted, admitted + 1));
+    pending_sessions.push(std::move(conn));
+  }
 
+  void serve_sessions() {
+    // reused by every session of the thread, so that it stops allocating
+    streamable_buffer sbuffer;
+    sbuffer.set_limits(client_msg_limits);
     while (true) {
-      // println("Waiting for client...");
-      std::shared_ptr<tcp::socket> sock {new tcp::socket(io_service)};
-      a.accept(*sock);
-      sock->set_option(ip::tcp::no_delay(true));
-      std::thread handler {
-        [this, sock] { this->handle_session(sock); }
-      };
-      handler.detach();
+      std::shared_ptr<connection> conn = pending_sessions.pop();
+      handle_session(conn, sbuffer);
+      sbuffer.clear();
+      --sessions;
     }
   }
 
+  void accept_clients() {
+    backend->serve(port, [this] (std::shared_ptr<connection> conn) { accept_client(conn); });
+  }
+
+  void accept_shm_clients() {
+#ifdef BOMBERMAN_HAS_SHM
+    shm_listener listener;
+    listener.serve(*shm_path, [this] (std::shared_ptr<connection> conn) { accept_client(conn); });
+#endif
+  }
+
   void start() {
+    std::vector<std::thread> session_workers;
+    for (size_t i=0; i < max_clients; ++i) {
+      session_workers.emplace_back([this] { serve_sessions(); });
+    }
     std::thread acceptor {[this] { accept_clients(); }};
+    std::thread broadcaster {[this] { run_broadcasts(); }};
+    std::thread shm_acceptor;
+    if (shm_path) {
+      shm_acceptor = std::thread {[this] { accept_shm_clients(); }};
+    }
+    std::thread receiver;
+    if (supported_features & FEATURE_UDP) {
+      udp_socket.emplace(udp_io, udp::endpoint(udp::v6(), port));
+      receiver = std::thread {[this] { receive_datagrams(); }};
+    }
 
     std::chrono::duration<turn_duration_t, std::milli> turn_duration {params.turn_duration};
     while (true) {
@@ -382,7 +898,7 @@ public:
       state = State::Lobby;
       await_players();
       init_game();
-      broadcast_message(ServerMessageGameStarted {});
+      broadcast_in_order([this] { broadcast_message(ServerMessageGameStarted {}); });
       for (game_length_t turn = 0; turn < params.game_length; ++turn) {
         broadcast_turn(turn);
         state = State::Playing;
@@ -392,43 +908,56 @@ public:
       }
       finish_game();
       println("End of game!");
+      // counted anew for every game
+      uint64_t dropped = messages_dropped.exchange(0);
+      uint64_t cut_off = clients_cut_off.exchange(0);
+      if (dropped > 0) {
+        println("Messages dropped over the rate limit:", dropped,
+                "clients disconnected for it:", cut_off);
+      }
+#ifdef BOMBERMAN_LOCK_PROFILING
+      lock_profiler::report(std::cout);
+#endif
     }
 
     acceptor.join();
+    broadcaster.join();
+    if (shm_acceptor.joinable()) { shm_acceptor.join(); }
+    if (receiver.joinable()) { receiver.join(); }
+    for (std::thread& worker : session_workers) { worker.join(); }
   }
 
-  void handle_session(std::shared_ptr<tcp::socket> sock) {
-    {
-      // we do so without getting mutex - because the mutex we use for the
-      // whole map and here we modify something that only this thread accesses
-      // also, do it before client_connected, because afterwise writes may
-      // occur to this socket in another thread
-      streamable_buffer sbuffer;
-      sbuffer << hello;
-      try {
-        send(sbuffer, *sock);
-      } catch (const boost::system::system_error& e) {
-        std::cerr << "Error: unable to send hello" << std::endl;
-        return;
-      }
+  void handle_session(std::shared_ptr<connection> conn, streamable_buffer& sbuffer) {
+    // we do so without getting mutex - because the mutex we use for the
+    // whole map and here we modify something that only this thread accesses
+    // also, do it before client_connected, because afterwise writes may
+    // occur to this socket in another thread
+    try {
+      conn->send(encoded_hello);
+    } catch (const boost::system::system_error& e) {
+      std::cerr << "Error: unable to send hello" << std::endl;
+      return;
     }
 
     ip::tcp::endpoint client_endpoint;
 
     try {
-      client_endpoint = sock->remote_endpoint();
-      client_connected(sock);
+      client_endpoint = conn->remote_endpoint();
+      client_connected(conn);
     } catch (const boost::system::system_error& e) {
       std::cerr << "Error: unable to connect client" << std::endl;
       return;
     }
 
-    streamable_buffer sbuffer;
-    sbuffer.set_provider([sock](size_t n){ return read(*sock, n); });
+    // outlives the session, but is replaced before it's called again
+    sbuffer.set_provider([&conn = *conn](std::span<unsigned char> out){ conn.read(out); });
+    token_bucket budget {params.msg_rate, params.msg_burst};
+    uint64_t dropped = 0;
 
     while (true) {
       ClientMessage msg;
       try {
+        sbuffer.begin_message();
         sbuffer >> msg;
       } catch (const boost::system::system_error& e) {
         std::cerr << "Error: unable to read from client" << std::endl;
@@ -440,6 +969,18 @@ public:
         return;
       }
 
+      // over the budget: dropped before anything is locked or logged
+      if (!budget.take()) {
+        ++messages_dropped;
+        if (++dropped == params.msg_drop_limit) {
+          std::cerr << "Client: Too many messages" << std::endl;
+          ++clients_cut_off;
+          client_disconnected(client_endpoint);
+          return;
+        }
+        continue;
+      }
+
       if (std::holds_alternative<ClientMessageMove>(msg)) {
         if (std::get<ClientMessageMove>(msg).direction > 3) {
           std::cerr << "Client: Invalid direction value" << std::endl;
@@ -482,6 +1023,55 @@ int main(int argc, char* argv[]) {
     )
     ("size-x,x", po::value<pos_t>()->required(), "size x")
     ("size-y,y", po::value<pos_t>()->required(), "size y")
+    (
+      "interest-radius,r",
+      po::value<pos_t>()->default_value(0),
+      "send players only the events within that distance of their robot (0: all events)"
+    )
+    (
+      "turn-workers,w",
+      po::value<unsigned>()->default_value(0),
+      "threads resolving the turns next to the game thread (0: resolved serially)"
+    )
+    ("udp", po::bool_switch(), "let clients get the turns over UDP (not with --interest-radius)")
+    (
+      "udp-loss",
+      po::value<double>()->default_value(0),
+      "share of the turn datagrams to drop, to test the UDP channel"
+    )
+#ifdef BOMBERMAN_HAS_SHM
+    ("shm", po::value<std::string>(), "also serve clients on this host over shared memory, at that Unix socket path")
+#endif
+    (
+      "backend",
+      po::value<std::string>()->default_value("asio"),
+      "networking backend: asio, or io_uring on Linux"
+    )
+    (
+      "hash-interval",
+      po::value<game_length_t>()->default_value(10),
+      "send the clients which ask for it the hash of the state every that many turns (0: never; not with --interest-radius)"
+    )
+    (
+      "msg-rate",
+      po::value<double>()->default_value(200),
+      "messages per second a client may send, the ones over it are dropped (0: unlimited)"
+    )
+    (
+      "msg-burst",
+      po::value<double>()->default_value(400),
+      "messages a client may send at once, within --msg-rate"
+    )
+    (
+      "msg-drop-limit",
+      po::value<uint64_t>()->default_value(0),
+      "disconnect a client once that many of its messages have been dropped (0: never)"
+    )
+    (
+      "acceptors",
+      po::value<size_t>()->default_value(1),
+      "threads accepting connections, each on its own SO_REUSEPORT socket (asio backend)"
+    )
     ;
 
   po::variables_map vm;
@@ -504,6 +1094,10 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
+#ifdef BOMBERMAN_LOCK_PROFILING
+  lock_profiler::report_on_termination();
+#endif
+
   uint32_t raw_n_players = vm["players-count"].as<uint32_t>();
   if (raw_n_players > std::numeric_limits<players_count_t>::max()) {
     std::cerr << "Too many players required! Should be 0-255" << std::endl;
@@ -519,13 +1113,59 @@ int main(int argc, char* argv[]) {
     .game_length = vm["game-length"].as<game_length_t>(),
     .server_name = vm["server-name"].as<server_name_t>(),
     .size_x = vm["size-x"].as<pos_t>(),
-    .size_y = vm["size-y"].as<pos_t>()
+    .size_y = vm["size-y"].as<pos_t>(),
+    .interest_radius = vm["interest-radius"].as<pos_t>(),
+    .turn_workers = vm["turn-workers"].as<unsigned>(),
+    .udp = vm["udp"].as<bool>(),
+    .udp_loss = vm["udp-loss"].as<double>(),
+    .hash_interval = vm["hash-interval"].as<game_length_t>(),
+    .msg_rate = vm["msg-rate"].as<double>(),
+    .msg_burst = vm["msg-burst"].as<double>(),
+    .msg_drop_limit = vm["msg-drop-limit"].as<uint64_t>()
   };
+  if (params.udp_loss < 0 || params.udp_loss > 1) {
+    std::cerr << "The share of datagrams to drop should be 0-1" << std::endl;
+    return 1;
+  }
+  if (params.msg_rate < 0 || (params.msg_rate > 0 && params.msg_burst < 1)) {
+    std::cerr << "The message rate can't be negative, and its burst should be 1 at least" << std::endl;
+    return 1;
+  }
 
   port_t port = vm["port"].as<port_t>();
   seed_t seed = vm["seed"].as<seed_t>();
 
-  Server server (params, port, seed);
+  std::unique_ptr<network_backend> backend;
+  std::string backend_name = vm["backend"].as<std::string>();
+  try {
+    if (backend_name == "asio") {
+      size_t acceptors = vm["acceptors"].as<size_t>();
+      if (acceptors == 0) {
+        std::cerr << "There must be at least one acceptor" << std::endl;
+        return 1;
+      }
+      if (acceptors > 1 && !asio_backend::reuse_port_supported()) {
+        std::cerr << "More than one acceptor needs SO_REUSEPORT" << std::endl;
+        return 1;
+      }
+      backend = std::make_unique<asio_backend>(acceptors);
+#ifdef BOMBERMAN_HAS_IO_URING
+    } else if (backend_name == "io_uring") {
+      backend = std::make_unique<io_uring_backend>();
+#endif
+    } else {
+      std::cerr << "Unknown backend: " << backend_name << std::endl;
+      return 1;
+    }
+  } catch (const std::system_error& e) {
+    std::cerr << "Unable to set up the backend: " << e.what() << std::endl;
+    return 1;
+  }
+
+  std::optional<std::string> shm_path;
+  if (vm.count("shm")) { shm_path = vm["shm"].as<std::string>(); }
+
+  Server server (params, port, seed, std::move(backend), std::move(shm_path));
   server.start();
 
   return 0;
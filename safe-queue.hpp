@@ -11,6 +11,7 @@ class safe_queue {
   std::deque<T> que;
   bool destroying = false;
   std::condition_variable cond_que;
+  std::condition_variable cond_room;
   std::mutex mutex_que;
 
 public:
@@ -20,6 +21,7 @@ public:
     std::scoped_lock lock {mutex_que};
     destroying = true;
     cond_que.notify_all();
+    cond_room.notify_all();
   }
 
   void push(T t) {
@@ -31,6 +33,19 @@ public:
     cond_que.notify_one();
   }
 
+  // Like push, but waits for room instead of throwing
+  void push_wait(T t) {
+    std::unique_lock lock {mutex_que};
+    cond_room.wait(lock,
+      [this] { return que.size() < max_size || destroying; }
+    );
+    if (destroying) {
+      throw std::runtime_error("Queue destroyed");
+    }
+    que.push_back(t);
+    cond_que.notify_one();
+  }
+
   T pop() {
     std::unique_lock lock {mutex_que};
     if (que.empty()) {
@@ -43,6 +58,7 @@ public:
     }
     T val = que.front();
     que.pop_front();
+    cond_room.notify_one();
     return val;
   }
 
@@ -51,6 +67,7 @@ public:
     if (que.empty()) { throw std::runtime_error("Queue empty"); }
     T val = que.front();
     que.pop_front();
+    cond_room.notify_one();
     return val;
   }
 };
@@ -1,11 +1,19 @@
 #ifndef BOMBERMAN_SERIALIZATION_HPP
 #define BOMBERMAN_SERIALIZATION_HPP
 
+#include <algorithm> // std::min
+#include <array>
+#include <cstring> // std::memcpy
 #include <limits>
+#include <ranges>
+#include <type_traits> // std::type_identity
+#include <utility> // std::index_sequence
 #include <variant>
 
 #include "boost/pfr.hpp"
+#include <boost/endian/conversion.hpp>
 
+#include "byte-order.hpp"
 #include "messages.hpp"
 
 class invalid_message : public std::runtime_error {
@@ -15,13 +23,179 @@ class invalid_message : public std::runtime_error {
 template <typename T>
 concept is_class = std::is_class<T>::value;
 
+// Lower bound on the encoded size of a value of the given type, in the
+// legacy format. Used to validate length prefixes against the bytes left.
+template <std::unsigned_integral T>
+constexpr size_t min_wire_size(std::type_identity<T>) { return sizeof(T); }
+
+constexpr size_t min_wire_size(std::type_identity<std::string>) {
+  return sizeof(strlen_t);
+}
+
+template <typename T>
+constexpr size_t min_wire_size(std::type_identity<std::vector<T>>) {
+  return sizeof(uint32_t);
+}
+
+template <typename T, typename U>
+constexpr size_t min_wire_size(std::type_identity<std::map<T, U>>) {
+  return sizeof(uint32_t);
+}
+
+template <typename ... Ts>
+constexpr size_t min_wire_size(std::type_identity<std::variant<Ts ...>>);
+
+template <is_class Compound>
+constexpr size_t min_wire_size(std::type_identity<Compound>) {
+  return []<size_t ... Is>(std::index_sequence<Is ...>) {
+    return (size_t {0} + ... + min_wire_size(
+      std::type_identity<boost::pfr::tuple_element_t<Is, Compound>> {}
+    ));
+  }(std::make_index_sequence<boost::pfr::tuple_size_v<Compound>> {});
+}
+
+template <typename ... Ts>
+constexpr size_t min_wire_size(std::type_identity<std::variant<Ts ...>>) {
+  return sizeof(msg_id_t) + std::min({min_wire_size(std::type_identity<Ts> {}) ...});
+}
+
+template <typename T>
+constexpr size_t min_wire_size_v = min_wire_size(std::type_identity<T> {});
+
+// Whether the type always has the same encoding length: unsigned integers
+// and structs built only out of them, e.g. Position or EventPlayerMoved.
+// For those min_wire_size_v is the exact size.
+template <typename T>
+constexpr bool fixed_layout_v = [] {
+  if constexpr (std::unsigned_integral<T>) {
+    return true;
+  } else if constexpr (std::is_aggregate_v<T>) {
+    return []<size_t ... Is>(std::index_sequence<Is ...>) {
+      return (true && ... && fixed_layout_v<boost::pfr::tuple_element_t<Is, T>>);
+    }(std::make_index_sequence<boost::pfr::tuple_size_v<T>> {});
+  } else {
+    return false;
+  }
+}();
+
+template <typename T>
+concept fixed_layout = is_class<T> && fixed_layout_v<T>;
+
+// Width of the integers a fixed layout consists of, 0 if they differ
+template <typename T>
+constexpr size_t lane_size_v = [] {
+  if constexpr (std::unsigned_integral<T>) {
+    return sizeof(T);
+  } else if constexpr (fixed_layout_v<T> && boost::pfr::tuple_size_v<T> > 0) {
+    return []<size_t ... Is>(std::index_sequence<Is ...>) {
+      constexpr std::array<size_t, sizeof...(Is)> lanes {
+        lane_size_v<boost::pfr::tuple_element_t<Is, T>> ...
+      };
+      for (size_t lane : lanes) {
+        if (lane != lanes[0]) { return size_t {0}; }
+      }
+      return lanes[0];
+    }(std::make_index_sequence<boost::pfr::tuple_size_v<T>> {});
+  } else {
+    return size_t {0};
+  }
+}();
+
+// Elements which are laid out in memory exactly like on the wire, up to the
+// byte order of their integers, e.g. Position or Bomb. Arrays of them are
+// copied at once and converted with a single pass over the bytes.
+template <typename T>
+concept bulk_copyable =
+  std::is_trivially_copyable_v<T>
+  && lane_size_v<T> != 0
+  && sizeof(T) == min_wire_size_v<T>;
+
+// Reject a length prefix in O(1), before anything is allocated for it
+void claim(streamable_buffer& stream, uint64_t count, size_t min_size) {
+  if (!stream.claim(count, min_size)) {
+    throw invalid_message("length exceeds the message budget");
+  }
+}
+
+// LEB128-style unsigned integer: 7 bits per byte, high bit set on all the
+// bytes but the last one. Used only by the compact wire format.
+struct varint {
+  uint64_t value;
+};
+
+streamable_buffer& operator<<(streamable_buffer& stream, varint v) {
+  do {
+    uint8_t byte = static_cast<uint8_t>(v.value & 0x7f);
+    v.value >>= 7;
+    if (v.value) { byte |= 0x80; }
+    stream << byte;
+  } while (v.value);
+  return stream;
+}
+
+streamable_buffer& operator>>(streamable_buffer& stream, varint& v) {
+  v.value = 0;
+  for (unsigned shift = 0; ; shift += 7) {
+    if (shift >= 64) { throw invalid_message("varint too long"); }
+    uint8_t byte;
+    stream >> byte;
+    v.value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) { break; }
+  }
+  return stream;
+}
+
+// Codes positions as zigzag varint deltas from the previously coded one, so
+// that the spatially close positions (e.g. a robot moving to an adjacent
+// cell, or sorted blocks) take two bytes instead of four.
+class position_coder {
+  Position last {0, 0};
+
+public:
+  // both deltas take at least one byte
+  static constexpr size_t min_size = 2;
+
+private:
+  static uint64_t zigzag(int32_t d) {
+    return static_cast<uint32_t>((d << 1) ^ (d >> 31));
+  }
+
+  static int32_t unzigzag(uint64_t z) {
+    return static_cast<int32_t>(z >> 1) ^ -static_cast<int32_t>(z & 1);
+  }
+
+  static pos_t apply(pos_t base, uint64_t z) {
+    if (z > std::numeric_limits<uint32_t>::max()) {
+      throw invalid_message("position delta too long");
+    }
+    int32_t coord = base + unzigzag(z);
+    if (coord < 0 || coord > std::numeric_limits<pos_t>::max()) {
+      throw invalid_message("position out of range");
+    }
+    return static_cast<pos_t>(coord);
+  }
+
+public:
+  void encode(streamable_buffer& stream, const Position& pos) {
+    stream << varint {zigzag(pos.x - last.x)} << varint {zigzag(pos.y - last.y)};
+    last = pos;
+  }
+
+  Position decode(streamable_buffer& stream) {
+    varint dx, dy;
+    stream >> dx >> dy;
+    last = Position { .x = apply(last.x, dx.value), .y = apply(last.y, dy.value) };
+    return last;
+  }
+};
+
 streamable_buffer& operator<<(streamable_buffer& stream, const std::string& s) {
   if (s.size() > std::numeric_limits<uint8_t>::max()) {
     throw invalid_message("string too long");
   }
 
   stream << (uint8_t) s.size();
-  for (uint8_t c : s) { stream << c; };
+  stream.write(reinterpret_cast<const unsigned char*>(s.data()), s.size());
   return stream;
 }
 
@@ -31,7 +205,14 @@ streamable_buffer& operator<<(streamable_buffer& stream, const std::vector<T>& s
     throw invalid_message("vector too long");
   }
   stream << (uint32_t)s.size();
-  for (const T& c : s) { stream << c; };
+  if constexpr (bulk_copyable<T>) {
+    size_t bytes = s.size() * sizeof(T);
+    unsigned char* out = stream.extend(bytes);
+    if (bytes > 0) { std::memcpy(out, s.data(), bytes); }
+    big_endian_lanes<lane_size_v<T>>(out, bytes / lane_size_v<T>);
+  } else {
+    for (const T& c : s) { stream << c; };
+  }
   return stream;
 }
 
@@ -46,13 +227,13 @@ streamable_buffer& operator<<(streamable_buffer& stream, const std::map<T, U>& s
 }
 
 template <typename ... Ts>
-streamable_buffer& operator<<(streamable_buffer& stream, std::variant<Ts ...>& variant) {
-  std::visit([&stream](auto&& x){ stream << x; }, variant);
+streamable_buffer& operator<<(streamable_buffer& stream, const std::variant<Ts ...>& variant) {
+  std::visit([&stream](const auto& x){ stream << x; }, variant);
   return stream;
 }
 
 template <is_class Compound>
-streamable_buffer& operator<<(streamable_buffer& stream, Compound obj) {
+streamable_buffer& operator<<(streamable_buffer& stream, const Compound& obj) {
   if constexpr (requires {obj.msg_id;}) {
     stream << obj.msg_id;
   }
@@ -63,12 +244,74 @@ streamable_buffer& operator<<(streamable_buffer& stream, Compound obj) {
   return stream;
 }
 
-// unfortunately PFR doesn't support members with std::variant type
-streamable_buffer& operator<<(streamable_buffer& stream, ServerMessageTurn& msg) {
-  stream << msg.msg_id << msg.turn;
-  for (const Event& e : msg.events) {
-    std::visit([&stream] (auto&& x) { stream << x; }, e);
+// Compact encoding of a turn: msg_id, varint turn, varint number of runs and
+// the runs themselves. A run is a varint header (length << 2 | event index)
+// followed by that many events of the same kind, without their msg_ids.
+static_assert(std::variant_size_v<Event> <= 4, "event index must fit 2 bits");
+
+void encode_compact(streamable_buffer& stream, position_coder& coder, const EventBombPlaced& e) {
+  stream << varint {e.bomb_id};
+  coder.encode(stream, e.position);
+}
+
+void encode_compact(streamable_buffer& stream, position_coder& coder, const EventBombExploded& e) {
+  stream << varint {e.bomb_id} << varint {e.robots_destroyed.size()};
+  for (player_id_t player_id : e.robots_destroyed) { stream << player_id; }
+  stream << varint {e.blocks_destroyed.size()};
+  for (const Position& pos : e.blocks_destroyed) { coder.encode(stream, pos); }
+}
+
+void encode_compact(streamable_buffer& stream, position_coder& coder, const EventPlayerMoved& e) {
+  stream << e.player_id;
+  coder.encode(stream, e.position);
+}
+
+void encode_compact(streamable_buffer& stream, position_coder& coder, const EventBlockPlaced& e) {
+  coder.encode(stream, e.position);
+}
+
+template <std::ranges::random_access_range Events>
+void encode_compact(streamable_buffer& stream, game_length_t turn, const Events& events) {
+  size_t size = std::ranges::size(events);
+  size_t runs = 0;
+  for (size_t i=0; i < size; ++i) {
+    if (i == 0 || events[i].index() != events[i - 1].index()) { ++runs; }
+  }
+
+  stream << ServerMessageTurn::msg_id << varint {turn} << varint {runs};
+  position_coder coder;
+  for (size_t i=0; i < size; ) {
+    size_t run_end = i;
+    while (run_end < size && events[run_end].index() == events[i].index()) {
+      ++run_end;
+    }
+    stream << varint {((run_end - i) << 2) | events[i].index()};
+    for (; i < run_end; ++i) {
+      std::visit([&stream, &coder] (const auto& e) { encode_compact(stream, coder, e); }, events[i]);
+    }
+  }
+}
+
+// Encode a ServerMessageTurn made of the given events, which can be any
+// random access range of them, e.g. a filtered view of a turn
+template <std::ranges::random_access_range Events>
+void encode_turn(streamable_buffer& stream, game_length_t turn, const Events& events) {
+  if (stream.get_format() == wire_format::compact) {
+    encode_compact(stream, turn, events);
+    return;
+  }
+
+  size_t size = std::ranges::size(events);
+  if (size > std::numeric_limits<uint32_t>::max()) {
+    throw invalid_message("vector too long");
   }
+  stream << ServerMessageTurn::msg_id << turn << (uint32_t)size;
+  for (const Event& e : events) { stream << e; }
+}
+
+// unfortunately PFR doesn't support members with std::variant type
+streamable_buffer& operator<<(streamable_buffer& stream, const ServerMessageTurn& msg) {
+  encode_turn(stream, msg.turn, msg.events);
   return stream;
 }
 
@@ -76,12 +319,9 @@ streamable_buffer& operator<<(streamable_buffer& stream, ServerMessageTurn& msg)
 streamable_buffer& operator>>(streamable_buffer& stream, std::string& s) {
   uint8_t size;
   stream >> size;
-  s.clear();
-  for (size_t i=0; i < size; ++i) {
-    uint8_t c;
-    stream >> c;
-    s += c;
-  }
+  claim(stream, size, 1);
+  s.resize(size);
+  stream.read(reinterpret_cast<unsigned char*>(s.data()), size);
   return stream;
 }
 
@@ -89,11 +329,20 @@ template <typename T>
 streamable_buffer& operator>>(streamable_buffer& stream, std::vector<T>& s) {
   uint32_t size;
   stream >> size;
+  claim(stream, size, min_wire_size_v<T>);
   s.clear();
-  for (size_t i=0; i < size; ++i) {
-    T c;
-    stream >> c;
-    s.push_back(c);
+  if constexpr (bulk_copyable<T>) {
+    s.resize(size);
+    unsigned char* out = reinterpret_cast<unsigned char*>(s.data());
+    stream.read(out, size * sizeof(T));
+    big_endian_lanes<lane_size_v<T>>(out, size * sizeof(T) / lane_size_v<T>);
+  } else {
+    s.reserve(size);
+    for (size_t i=0; i < size; ++i) {
+      T c;
+      stream >> c;
+      s.push_back(c);
+    }
   }
   return stream;
 }
@@ -102,6 +351,7 @@ template <typename T, typename U>
 streamable_buffer& operator>>(streamable_buffer& stream, std::map<T, U>& s) {
   uint32_t size;
   stream >> size;
+  claim(stream, size, min_wire_size_v<T> + min_wire_size_v<U>);
   s.clear();
   for (size_t i=0; i < size; ++i) {
     T key;
@@ -112,6 +362,31 @@ streamable_buffer& operator>>(streamable_buffer& stream, std::map<T, U>& s) {
   return stream;
 }
 
+template <std::unsigned_integral T>
+void load_fixed(const unsigned char*& data, T& t) {
+  t = boost::endian::endian_load<T, sizeof(T), boost::endian::order::big>(data);
+  data += sizeof(T);
+}
+
+template <is_class Compound>
+void load_fixed(const unsigned char*& data, Compound& obj) {
+  boost::pfr::for_each_field(
+    obj,
+    [&data](auto& elt) { load_fixed(data, elt); }
+  );
+}
+
+// Fixed-size structs are read with a single bounds check into a local
+// array and then unpacked from it, instead of byte by byte from the stream
+template <fixed_layout Compound>
+streamable_buffer& operator>>(streamable_buffer& stream, Compound& obj) {
+  std::array<unsigned char, min_wire_size_v<Compound>> raw;
+  stream.read(raw.data(), raw.size());
+  const unsigned char* data = raw.data();
+  load_fixed(data, obj);
+  return stream;
+}
+
 template <is_class Compound>
 streamable_buffer& operator>>(streamable_buffer& stream, Compound& obj) {
   obj = {};
@@ -122,27 +397,123 @@ streamable_buffer& operator>>(streamable_buffer& stream, Compound& obj) {
   return stream;
 }
 
-template <typename Variant, size_t I = 0, typename Stream>
-Variant get(Stream& s, size_t msg_id) {
-  if constexpr (I >= std::variant_size_v<Variant>) {
-    throw invalid_message("unknown message id");
-  } else if (I == msg_id) {
-    typename std::variant_alternative_t<I, Variant> obj;
-    boost::pfr::for_each_field(
-      obj,
-      [&s](auto& elt) { s >> elt; }
-    );
-    return obj;
-  } else {
-    return get<Variant, I + 1, Stream>(s, msg_id); 
+void decode_compact(streamable_buffer& stream, position_coder& coder, EventBombPlaced& e) {
+  varint bomb_id;
+  stream >> bomb_id;
+  if (bomb_id.value > std::numeric_limits<bomb_id_t>::max()) {
+    throw invalid_message("bomb id out of range");
+  }
+  e.bomb_id = static_cast<bomb_id_t>(bomb_id.value);
+  e.position = coder.decode(stream);
+}
+
+void decode_compact(streamable_buffer& stream, position_coder& coder, EventBombExploded& e) {
+  varint bomb_id, robots, blocks;
+  stream >> bomb_id;
+  if (bomb_id.value > std::numeric_limits<bomb_id_t>::max()) {
+    throw invalid_message("bomb id out of range");
+  }
+  e.bomb_id = static_cast<bomb_id_t>(bomb_id.value);
+  stream >> robots;
+  claim(stream, robots.value, sizeof(player_id_t));
+  e.robots_destroyed.reserve(robots.value);
+  for (uint64_t i=0; i < robots.value; ++i) {
+    player_id_t player_id;
+    stream >> player_id;
+    e.robots_destroyed.push_back(player_id);
+  }
+  stream >> blocks;
+  claim(stream, blocks.value, position_coder::min_size);
+  e.blocks_destroyed.reserve(blocks.value);
+  for (uint64_t i=0; i < blocks.value; ++i) {
+    e.blocks_destroyed.push_back(coder.decode(stream));
+  }
+}
+
+void decode_compact(streamable_buffer& stream, position_coder& coder, EventPlayerMoved& e) {
+  stream >> e.player_id;
+  e.position = coder.decode(stream);
+}
+
+void decode_compact(streamable_buffer& stream, position_coder& coder, EventBlockPlaced& e) {
+  e.position = coder.decode(stream);
+}
+
+template <typename T>
+void decode_compact_run(
+  streamable_buffer& stream,
+  position_coder& coder,
+  uint64_t length,
+  std::vector<Event>& events
+) {
+  for (uint64_t i=0; i < length; ++i) {
+    T e {};
+    decode_compact(stream, coder, e);
+    events.push_back(e);
   }
 }
 
+using decode_compact_run_t =
+  void (*)(streamable_buffer&, position_coder&, uint64_t, std::vector<Event>&);
+
+constexpr auto decode_compact_runs = []<size_t ... Is>(std::index_sequence<Is ...>) {
+  return std::array<decode_compact_run_t, sizeof...(Is)> {
+    &decode_compact_run<std::variant_alternative_t<Is, Event>> ...
+  };
+}(std::make_index_sequence<std::variant_size_v<Event>> {});
+
+// the msg_id has already been consumed by the variant decoder
+streamable_buffer& operator>>(streamable_buffer& stream, ServerMessageTurn& msg) {
+  msg = {};
+  if (stream.get_format() != wire_format::compact) {
+    return stream >> msg.turn >> msg.events;
+  }
+
+  varint turn, runs;
+  stream >> turn >> runs;
+  if (turn.value > std::numeric_limits<game_length_t>::max()) {
+    throw invalid_message("turn out of range");
+  }
+  msg.turn = static_cast<game_length_t>(turn.value);
+
+  claim(stream, runs.value, 1);
+  position_coder coder;
+  for (uint64_t i=0; i < runs.value; ++i) {
+    varint header;
+    stream >> header;
+    size_t event_id = header.value & 3;
+    if (event_id >= decode_compact_runs.size()) {
+      throw invalid_message("unknown event id");
+    }
+    claim(stream, header.value >> 2, 1);
+    decode_compact_runs[event_id](stream, coder, header.value >> 2, msg.events);
+  }
+  return stream;
+}
+
+// Decoding of a variant goes through a table of decoders indexed by msg_id,
+// generated at compile time for every variant type
+template <typename Variant, size_t I, typename Stream>
+void decode_alternative(Stream& s, Variant& variant) {
+  s >> variant.template emplace<I>();
+}
+
+template <typename Variant, typename Stream>
+constexpr auto decode_table = []<size_t ... Is>(std::index_sequence<Is ...>) {
+  return std::array<void (*)(Stream&, Variant&), sizeof...(Is)> {
+    &decode_alternative<Variant, Is, Stream> ...
+  };
+}(std::make_index_sequence<std::variant_size_v<Variant>> {});
+
 template <typename ... Ts>
 streamable_buffer& operator>>(streamable_buffer& stream, std::variant<Ts ...>& variant) {
   uint8_t msg_id;
   stream >> msg_id;
-  variant = get<std::variant<Ts ...>>(stream, msg_id);
+  constexpr auto& table = decode_table<std::variant<Ts ...>, streamable_buffer>;
+  if (msg_id >= table.size()) {
+    throw invalid_message("unknown message id");
+  }
+  table[msg_id](stream, variant);
   return stream;
 }
 
@@ -0,0 +1,370 @@
+/* Shared memory transport for clients on the same host as the server, chosen
+ * with a "shm:<path>" server address. The client connects to the server's Unix
+ * socket at the path and gets, with SCM_RIGHTS, a memfd holding a single
+ * producer, single consumer byte ring for either direction, and the eventfds
+ * which wake up a side waiting for data or for room. The serialized messages
+ * flow through the rings exactly as through the TCP stream. A side with
+ * nothing to do spins for a while before going to sleep on its eventfd, and
+ * the other side only writes to the eventfd if it sees it asleep, so a busy
+ * connection makes no system calls. The Unix socket is then only watched, to
+ * notice that the peer is gone.
+ */
+
+#ifndef BOMBERMAN_SHM_TRANSPORT_HPP
+#define BOMBERMAN_SHM_TRANSPORT_HPP
+
+#include <algorithm> // std::min
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring> // std::memcpy
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "connection.hpp"
+
+namespace shm {
+  constexpr size_t ring_capacity = 1 << 20;
+  // how many times a side looks at a ring before going to sleep; on a single
+  // CPU spinning only keeps the other side from running
+  const int spin_limit = std::thread::hardware_concurrency() > 1 ? 1 << 11 : 0;
+
+  struct ring_control {
+    // bytes written and read so far; the ring holds head - tail of them
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint32_t> reader_asleep;
+    std::atomic<uint32_t> writer_asleep;
+  };
+  static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+  // The direction of rings[i] and data[i]
+  constexpr size_t to_server = 0;
+  constexpr size_t to_client = 1;
+
+  struct segment {
+    std::atomic<uint32_t> closed;
+    ring_control rings[2];
+    unsigned char data[2][ring_capacity];
+  };
+
+  // Passed along with the memfd: the eventfds of the reader and of the writer
+  // of either direction
+  using events_t = std::array<int, 4>;
+
+  int data_event(const events_t& events, size_t direction) { return events[2 * direction]; }
+  int room_event(const events_t& events, size_t direction) { return events[2 * direction + 1]; }
+
+  [[noreturn]] void fail(const char* what) {
+    throw std::system_error(errno, std::generic_category(), what);
+  }
+
+  void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  }
+
+  sockaddr_un unix_address(const std::string& path) {
+    sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+      errno = ENAMETOOLONG;
+      fail("shm socket path");
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return addr;
+  }
+}
+
+class shm_connection : public connection {
+  shm::segment* const segment;
+  const int sock;
+  const shm::events_t events;
+  // the direction this side writes
+  const size_t outbound;
+  const boost::asio::ip::tcp::endpoint endpoint;
+
+  // the server's broadcaster and sessions may send at the same time, but a
+  // ring has a single producer
+  std::mutex mutex_send;
+
+  // Spins, then sleeps until ready() returns true; throws once the
+  // connection is closed and it still doesn't
+  template <typename Ready>
+  void wait(std::atomic<uint32_t>& asleep, int event, Ready ready, boost::system::error_code error) {
+    for (int i=0; i < shm::spin_limit; ++i) {
+      if (ready()) { return; }
+      shm::cpu_relax();
+    }
+    // the other side checks the flag after publishing, and we check again
+    // after raising it, so one of us notices the other
+    asleep.store(1);
+    while (!ready()) {
+      if (segment->closed.load()) {
+        asleep.store(0);
+        throw boost::system::system_error(error);
+      }
+      pollfd fds[2] = {{event, POLLIN, 0}, {sock, POLLIN, 0}};
+      if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+        asleep.store(0);
+        throw boost::system::system_error(errno, boost::system::system_category());
+      }
+      if (fds[0].revents & POLLIN) {
+        eventfd_t count;
+        eventfd_read(event, &count);
+      }
+      // the peer never writes to the socket, it can only have gone away
+      if (fds[1].revents) { segment->closed.store(1); }
+    }
+    asleep.store(0);
+  }
+
+public:
+  shm_connection(shm::segment* segment, int sock, shm::events_t events, size_t outbound, boost::asio::ip::tcp::endpoint endpoint)
+    : segment(segment), sock(sock), events(events), outbound(outbound), endpoint(endpoint) {}
+
+  ~shm_connection() override {
+    munmap(segment, sizeof(shm::segment));
+    close(sock);
+    for (int event : events) {
+      if (event >= 0) { close(event); }
+    }
+  }
+
+  shm_connection(const shm_connection&) = delete;
+  shm_connection& operator=(const shm_connection&) = delete;
+
+  void send(std::span<const unsigned char> bytes) override {
+    std::scoped_lock lock {mutex_send};
+    if (segment->closed.load()) {
+      throw boost::system::system_error(boost::asio::error::broken_pipe);
+    }
+    shm::ring_control& ring = segment->rings[outbound];
+    unsigned char* data = segment->data[outbound];
+
+    size_t done = 0;
+    while (done < bytes.size()) {
+      uint64_t head = ring.head.load(std::memory_order_relaxed);
+      uint64_t tail = 0;
+      wait(ring.writer_asleep, shm::room_event(events, outbound), [&] {
+        tail = ring.tail.load();
+        return head - tail < shm::ring_capacity;
+      }, boost::asio::error::broken_pipe);
+
+      size_t n = std::min(bytes.size() - done, static_cast<size_t>(shm::ring_capacity - (head - tail)));
+      size_t offset = head % shm::ring_capacity;
+      size_t first = std::min(n, shm::ring_capacity - offset);
+      std::memcpy(data + offset, bytes.data() + done, first);
+      std::memcpy(data, bytes.data() + done + first, n - first);
+      ring.head.store(head + n);
+      if (ring.reader_asleep.load()) { eventfd_write(shm::data_event(events, outbound), 1); }
+      done += n;
+    }
+  }
+
+  void read(std::span<unsigned char> out) override {
+    size_t inbound = 1 - outbound;
+    shm::ring_control& ring = segment->rings[inbound];
+    const unsigned char* data = segment->data[inbound];
+
+    size_t done = 0;
+    while (done < out.size()) {
+      uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+      uint64_t head = 0;
+      wait(ring.reader_asleep, shm::data_event(events, inbound), [&] {
+        head = ring.head.load();
+        return head != tail;
+      }, boost::asio::error::eof);
+
+      size_t n = std::min(out.size() - done, static_cast<size_t>(head - tail));
+      size_t offset = tail % shm::ring_capacity;
+      size_t first = std::min(n, shm::ring_capacity - offset);
+      std::memcpy(out.data() + done, data + offset, first);
+      std::memcpy(out.data() + done + first, data, n - first);
+      ring.tail.store(tail + n);
+      if (ring.writer_asleep.load()) { eventfd_write(shm::room_event(events, inbound), 1); }
+      done += n;
+    }
+  }
+
+  // Wakes up both sides, which then find the connection closed
+  void shutdown() override {
+    segment->closed.store(1);
+    for (int event : events) { eventfd_write(event, 1); }
+    ::shutdown(sock, SHUT_RDWR);
+  }
+
+  boost::asio::ip::tcp::endpoint remote_endpoint() const override { return endpoint; }
+};
+
+// Accepts the shared memory connections of the server. They are told apart
+// by a made-up endpoint: an address of the discard prefix 100::/64 numbering
+// the connections, and the client's pid as the port.
+class shm_listener {
+  uint64_t connections = 0;
+
+  // Owns the socket, even if it throws
+  std::shared_ptr<shm_connection> accept(int sock) {
+    ucred peer {};
+    socklen_t peer_size = sizeof(peer);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &peer, &peer_size) < 0) {
+      close(sock);
+      shm::fail("shm peer");
+    }
+    boost::asio::ip::address_v6::bytes_type address {};
+    address[0] = 1;
+    uint64_t number = ++connections;
+    for (size_t i=0; i < sizeof(number); ++i) {
+      address[15 - i] = static_cast<unsigned char>(number >> (8 * i));
+    }
+    boost::asio::ip::tcp::endpoint endpoint {
+      boost::asio::ip::address_v6(address),
+      static_cast<port_t>(peer.pid)
+    };
+
+    int memfd = memfd_create("bomberman-shm", MFD_CLOEXEC);
+    void* mapped = MAP_FAILED;
+    if (memfd >= 0 && ftruncate(memfd, sizeof(shm::segment)) == 0) {
+      mapped = mmap(nullptr, sizeof(shm::segment), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    }
+    if (mapped == MAP_FAILED) {
+      int error = errno;
+      if (memfd >= 0) { close(memfd); }
+      close(sock);
+      errno = error;
+      shm::fail("shm segment");
+    }
+
+    shm::events_t events;
+    for (int& event : events) { event = eventfd(0, EFD_CLOEXEC); }
+    auto conn = std::make_shared<shm_connection>(
+      new (mapped) shm::segment, sock, events, shm::to_client, endpoint
+    );
+    if (std::any_of(events.begin(), events.end(), [] (int event) { return event < 0; })) {
+      close(memfd);
+      shm::fail("eventfd");
+    }
+
+    // how the client is seen, to tell which player it is
+    std::stringstream ss;
+    ss << endpoint;
+    std::string name = ss.str();
+
+    std::array<int, 5> fds {memfd, events[0], events[1], events[2], events[3]};
+    iovec payload {name.data(), name.size()};
+    alignas(cmsghdr) unsigned char control[CMSG_SPACE(sizeof(fds))] {};
+    msghdr msg {};
+    msg.msg_iov = &payload;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(fds));
+
+    ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    close(memfd);
+    if (sent < 0) { shm::fail("shm handshake"); }
+    return conn;
+  }
+
+public:
+  // Accepts connections at the path forever, passing them to the handler
+  void serve(const std::string& path, network_backend::accept_handler on_accept) {
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0) { shm::fail("shm socket"); }
+    sockaddr_un addr = shm::unix_address(path);
+    unlink(path.c_str());
+    if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) { shm::fail("shm bind"); }
+    if (listen(listener, SOMAXCONN) < 0) { shm::fail("shm listen"); }
+
+    // out of descriptors, until the sessions give some back
+    auto back_off = [] (int error) {
+      if (error == EMFILE || error == ENFILE) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      }
+    };
+    while (true) {
+      int sock = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+      if (sock < 0) {
+        int error = errno;
+        std::cerr << "Error: unable to accept: " << std::strerror(error) << std::endl;
+        back_off(error);
+        continue;
+      }
+      std::shared_ptr<shm_connection> conn;
+      try {
+        conn = accept(sock);
+      } catch (const std::system_error& e) {
+        std::cerr << "Error: unable to connect client" << std::endl;
+        back_off(e.code().value());
+        continue;
+      }
+      on_accept(conn);
+    }
+  }
+};
+
+// Connects to a server serving shared memory connections at the path;
+// `address` is set to how the server sees this client
+std::shared_ptr<shm_connection> shm_connect(const std::string& path, std::string& address) {
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) { shm::fail("shm socket"); }
+  sockaddr_un addr = shm::unix_address(path);
+  if (connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    close(sock);
+    shm::fail("shm connect");
+  }
+
+  std::array<int, 5> fds;
+  std::array<char, 128> name;
+  iovec payload {name.data(), name.size()};
+  alignas(cmsghdr) unsigned char control[CMSG_SPACE(sizeof(fds))] {};
+  msghdr msg {};
+  msg.msg_iov = &payload;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (received <= 0 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+    close(sock);
+    errno = EPROTO;
+    shm::fail("shm handshake");
+  }
+  std::memcpy(fds.data(), CMSG_DATA(cmsg), sizeof(fds));
+  address.assign(name.data(), static_cast<size_t>(received));
+
+  void* mapped = mmap(nullptr, sizeof(shm::segment), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+  close(fds[0]);
+  if (mapped == MAP_FAILED) {
+    close(sock);
+    for (size_t i=1; i < fds.size(); ++i) { close(fds[i]); }
+    shm::fail("shm mmap");
+  }
+  return std::make_shared<shm_connection>(
+    static_cast<shm::segment*>(mapped),
+    sock,
+    shm::events_t {fds[1], fds[2], fds[3], fds[4]},
+    shm::to_server,
+    boost::asio::ip::tcp::endpoint {}
+  );
+}
+
+#endif // BOMBERMAN_SHM_TRANSPORT_HPP
@@ -0,0 +1,50 @@
+/* Zobrist hash of a game state: the XOR of one key per robot position,
+ * block and bomb on the board, so adding or removing any of them is a single
+ * XOR, and the same state hashes the same whatever order it was reached in.
+ * The keys aren't drawn from a table but mixed out of the feature itself
+ * (splitmix64), so they are the same on every host, for boards of any size.
+ * The server keeps it along the events it generates and the client along
+ * the ones it applies; both get to the same value at the end of every turn.
+ */
+
+#ifndef BOMBERMAN_STATE_HASH_HPP
+#define BOMBERMAN_STATE_HASH_HPP
+
+#include <cstdint>
+
+#include "messages.hpp"
+
+class state_hash {
+  enum feature : uint64_t { robot = 1, block = 2, bomb = 3 };
+
+  uint64_t value = 0;
+
+  static uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+  }
+
+  static uint64_t key(feature kind, uint64_t id, const Position& pos) {
+    return mix((id << 8 | kind) ^ mix(static_cast<uint64_t>(pos.x) << 16 | pos.y));
+  }
+
+public:
+  // Each of these adds the feature if it isn't there and removes it if it is
+  void toggle_robot(player_id_t player_id, const Position& pos) { value ^= key(robot, player_id, pos); }
+  void toggle_block(const Position& pos) { value ^= key(block, 0, pos); }
+  void toggle_bomb(bomb_id_t bomb_id, const Position& pos) { value ^= key(bomb, bomb_id, pos); }
+
+  // Moves a robot which has been at `from`
+  void move_robot(player_id_t player_id, const Position& from, const Position& to) {
+    toggle_robot(player_id, from);
+    toggle_robot(player_id, to);
+  }
+
+  void clear() { value = 0; }
+
+  uint64_t get() const { return value; }
+};
+
+#endif // BOMBERMAN_STATE_HASH_HPP
@@ -1,19 +1,53 @@
 #ifndef BOMBERMAN_STREAMABLE_BUFFER_HPP
 #define BOMBERMAN_STREAMABLE_BUFFER_HPP
 
-#include <deque>
+#include <algorithm> // std::min
+#include <cstring> // std::memcpy
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <optional>
+#include <span>
 #include <type_traits> // std::unsigned_integral
+#include <vector>
 
 #include <boost/endian/conversion.hpp>
 
+// Encoding of the messages which have a compact variant (see serialization)
+enum class wire_format : uint8_t { legacy, compact };
+constexpr size_t wire_format_count = 2;
+
 class streamable_buffer {
-  std::deque<unsigned char> buffer;
+  // Contiguous, so that runs of bytes can be copied in and out at once.
+  // Bytes before `head` have already been read.
+  std::vector<unsigned char> buffer;
+  size_t head = 0;
+
+  // Set while decoding bytes owned by somebody else, in place of `buffer`
+  std::span<const unsigned char> view;
+  bool viewing = false;
+
+  const unsigned char* bytes() const { return viewing ? view.data() : buffer.data(); }
+  size_t stored() const { return viewing ? view.size() : buffer.size(); }
 
-  unsigned char byte_mask = std::numeric_limits<unsigned char>::max();
+  wire_format format = wire_format::legacy;
 
-  using provider_t = std::function<std::vector<unsigned char>(size_t n)>;
+public:
+  // Budget for a single decoded message, reset with begin_message. Lengths
+  // read off the wire are checked against it with claim before anything gets
+  // allocated for them.
+  struct decode_limits {
+    size_t max_bytes = std::numeric_limits<size_t>::max();
+    size_t max_elements = std::numeric_limits<size_t>::max();
+  };
+
+private:
+  decode_limits limits;
+  size_t bytes_read = 0;
+  size_t elements_claimed = 0;
+
+  // Fills the given span with the next bytes of the stream, e.g. from a socket
+  using provider_t = std::function<void(std::span<unsigned char>)>;
   std::optional<provider_t> provider;
 
 public:
@@ -34,51 +68,130 @@ public:
     buffer = { begin, end };
   }
 
-  bool empty() { return buffer.empty(); }
+  // Read from the given bytes, without copying them, until they are all
+  // consumed or the buffer is cleared; they must stay valid until then.
+  // Anything buffered before is dropped.
+  void assign_view(std::span<const unsigned char> bytes) {
+    clear();
+    view = bytes;
+    viewing = !bytes.empty();
+  }
+
+  bool empty() const { return head == stored(); }
+
+  // Number of buffered, unread bytes
+  size_t size() const { return stored() - head; }
 
   void set_provider(provider_t&& provider) {
     this->provider = provider;
   }
 
+  void set_format(wire_format format) { this->format = format; }
+
+  wire_format get_format() const { return format; }
+
+  void set_limits(decode_limits limits) { this->limits = limits; }
+
+  void begin_message() {
+    bytes_read = 0;
+    elements_claimed = 0;
+  }
+
+  // How many more bytes the current message may consume: what is buffered
+  // or, if more can be pulled from the provider, the rest of the budget.
+  size_t available() const {
+    size_t budget = limits.max_bytes - std::min(bytes_read, limits.max_bytes);
+    return provider ? budget : std::min(budget, size());
+  }
+
+  // Account for `count` elements of at least `min_size` bytes each.
+  // Returns false, claiming nothing, if they can't fit in the budget.
+  bool claim(uint64_t count, size_t min_size) {
+    if (count > limits.max_elements - elements_claimed) { return false; }
+    if (min_size > 0 && count > available() / min_size) { return false; }
+    elements_claimed += count;
+    return true;
+  }
+
+  // Append n uninitialized bytes and return a pointer to them
+  unsigned char* extend(size_t n) {
+    if (viewing) {
+      // appending to a view: its unread bytes have to be copied after all
+      buffer.assign(view.begin() + static_cast<std::ptrdiff_t>(head), view.end());
+      head = 0;
+      viewing = false;
+    }
+    size_t old_size = buffer.size();
+    buffer.resize(old_size + n);
+    return buffer.data() + old_size;
+  }
+
+  void write(const unsigned char* data, size_t n) {
+    if (n > 0) { std::memcpy(extend(n), data, n); }
+  }
+
   template <std::unsigned_integral T>
   streamable_buffer& operator<<(T t) {
-    t = boost::endian::native_to_big(t);
-    for (size_t i=0; i < sizeof(T); ++i) {
-      unsigned char byte = static_cast<unsigned char>((t >> (i * CHAR_BIT)) & (T)byte_mask);
-      buffer.push_back(byte);
-    }
+    boost::endian::endian_store<T, sizeof(T), boost::endian::order::big>(
+      extend(sizeof(T)), t
+    );
     return *this;
   }
 
-  template <std::unsigned_integral T>
-  streamable_buffer& operator>>(T& t) {
-    if (buffer.size() < sizeof(T)) {
+  // Make sure at least n bytes are buffered, pulling the missing ones from
+  // the provider in a single call
+  void ensure(size_t n) {
+    if (size() < n) {
       if (provider) {
-        auto data = (*provider)(sizeof(T) - buffer.size());
-        for (auto e : data) { *this << e; }
+        size_t missing = n - size();
+        unsigned char* out = extend(missing);
+        try {
+          (*provider)({out, missing});
+        } catch (...) {
+          buffer.resize(buffer.size() - missing);
+          throw;
+        }
       } else {
         //throw underflow_error("Buffer underflow");
-        throw buffer_underflow(sizeof(T) - buffer.size());
+        throw buffer_underflow(n - size());
       }
     }
+  }
 
-    t = 0;
-    for (size_t i=0; i < sizeof(T); ++i) {
-      unsigned char byte = buffer.front();
-      buffer.pop_front();
-      t = static_cast<unsigned char>((t << CHAR_BIT) | byte);
-    }
-    t = boost::endian::endian_reverse(t);
-    t = boost::endian::big_to_native(t);
+  // Pop n raw bytes at once
+  void read(unsigned char* out, size_t n) {
+    ensure(n);
+    if (n > 0) { std::memcpy(out, bytes() + head, n); }
+    consume(n);
+  }
+
+  template <std::unsigned_integral T>
+  streamable_buffer& operator>>(T& t) {
+    ensure(sizeof(T));
+    t = boost::endian::endian_load<T, sizeof(T), boost::endian::order::big>(
+      bytes() + head
+    );
+    consume(sizeof(T));
     return *this;
   }
 
-  const decltype(buffer)& get_buffer() {
-    return buffer;
+  // The unread bytes
+  std::span<const unsigned char> data() const {
+    return { bytes() + head, size() };
+  }
+
+  // Drop n unread bytes; the storage is recycled once everything is read
+  void consume(size_t n) {
+    head += n;
+    bytes_read += n;
+    if (head == stored()) { clear(); }
   }
 
+  // Keeps the capacity, so a reused buffer stops allocating
   void clear() {
     buffer.clear();
+    head = 0;
+    viewing = false;
   }
 
   friend std::ostream& operator<<(std::ostream&, const streamable_buffer&);
@@ -0,0 +1,62 @@
+/* A turn's changes to the board must be resolved in the server's order: a
+ * block placed within the turn doesn't stop that turn's blasts, and a block
+ * blown up where a new one is placed within the same turn is there after it.
+ */
+
+#include <algorithm> // std::ranges::find
+#include <iostream>
+#include <vector>
+
+#include "messages.hpp"
+#include "blast-map.hpp"
+
+int failed = 0;
+
+void check(bool ok, const char* what) {
+  if (!ok) {
+    std::cout << "Failed: " << what << std::endl;
+    failed = 1;
+  }
+}
+
+bool covers(const std::vector<Position>& cells, Position pos) {
+  return std::ranges::find(cells, pos) != cells.end();
+}
+
+int main() {
+  blast_map blast {10, 10};
+  blast.place(Position {.x = 5, .y = 2});
+
+  // the bomb at (2, 2) explodes in the turn a block is placed at (3, 2) in
+  // its right arm, and the one at (5, 2) is blown up and placed again
+  board_changes changes;
+  changes.exploded_bombs.push_back(Position {.x = 2, .y = 2});
+  changes.blocks_destroyed.insert(Position {.x = 5, .y = 2});
+  changes.blocks_placed.push_back(Position {.x = 3, .y = 2});
+  changes.blocks_placed.push_back(Position {.x = 5, .y = 2});
+
+  std::vector<Position> cells;
+  std::vector<Position> destroyed;
+  std::vector<Position> placed;
+  changes.resolve(blast, 3, cells,
+    [&] (const Position& pos) { destroyed.push_back(pos); },
+    [&] (const Position& pos) { placed.push_back(pos); });
+
+  check(covers(cells, Position {.x = 3, .y = 2}), "the arm covers the cell of the new block");
+  check(covers(cells, Position {.x = 4, .y = 2}), "the new block doesn't cut the arm");
+  check(covers(cells, Position {.x = 5, .y = 2}), "the arm reaches the old block");
+  check(destroyed == std::vector<Position> {{.x = 5, .y = 2}}, "the old block is destroyed");
+  check(placed.size() == 2, "both blocks are placed");
+  check(blast.contains(Position {.x = 3, .y = 2}), "the new block is on the board");
+  check(blast.contains(Position {.x = 5, .y = 2}), "the block placed again is on the board");
+  check(changes.blocks_placed.empty() && changes.exploded_bombs.empty(), "the changes are cleared");
+
+  // the next turn's blast is stopped by it
+  changes.exploded_bombs.push_back(Position {.x = 2, .y = 2});
+  cells.clear();
+  changes.resolve(blast, 3, cells, [] (const Position&) {}, [] (const Position&) {});
+  check(!covers(cells, Position {.x = 4, .y = 2}), "the block stops the next turn's arm");
+
+  if (!failed) { std::cout << "OK" << std::endl; }
+  return failed;
+}
@@ -0,0 +1,66 @@
+/* Encoding a turn into a reused buffer, as the broadcaster does every turn,
+ * must not allocate once the buffer has grown to fit. Counts every operator
+ * new of the process and fails if any happens in the steady state, in either
+ * wire format.
+ */
+
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+#include "messages.hpp"
+#include "streamable-buffer.hpp"
+#include "serialization.hpp"
+
+size_t allocations = 0;
+
+void* operator new(size_t size) {
+  ++allocations;
+  if (void* ptr = std::malloc(size > 0 ? size : 1)) { return ptr; }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+
+// Every kind of event, a few hundred of them
+ServerMessageTurn make_turn() {
+  ServerMessageTurn turn {.turn = 42, .events = {}};
+  for (uint16_t i=0; i < 100; ++i) {
+    Position pos {.x = i, .y = static_cast<pos_t>(100 - i)};
+    turn.events.push_back(EventPlayerMoved {.player_id = static_cast<player_id_t>(i % 8), .position = pos});
+    turn.events.push_back(EventBombPlaced {.bomb_id = i, .position = pos});
+    turn.events.push_back(EventBlockPlaced {.position = pos});
+    turn.events.push_back(EventBombExploded {
+      .bomb_id = i,
+      .robots_destroyed = {1, 2, 3},
+      .blocks_destroyed = {pos, Position {.x = pos.y, .y = pos.x}}
+    });
+  }
+  return turn;
+}
+
+int main() {
+  const ServerMessageTurn turn = make_turn();
+  int failed = 0;
+
+  for (wire_format format : {wire_format::legacy, wire_format::compact}) {
+    streamable_buffer sbuffer;
+    sbuffer.set_format(format);
+    // the buffer grows to fit the turn
+    sbuffer << turn;
+    sbuffer.clear();
+
+    size_t before = allocations;
+    for (int i=0; i < 1000; ++i) {
+      sbuffer << turn;
+      sbuffer.clear();
+    }
+    size_t allocated = allocations - before;
+
+    const char* name = format == wire_format::legacy ? "legacy" : "compact";
+    std::cout << name << ": " << allocated << " allocations in 1000 encodings" << std::endl;
+    if (allocated > 0) { failed = 1; }
+  }
+  return failed;
+}
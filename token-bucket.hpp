@@ -0,0 +1,38 @@
+/* Token bucket limiting how many messages a client may send: it holds up to
+ * `burst` tokens, refilled at `rate` per second, and every message takes
+ * one. Not thread-safe; every bucket belongs to a single session.
+ */
+
+#ifndef BOMBERMAN_TOKEN_BUCKET_HPP
+#define BOMBERMAN_TOKEN_BUCKET_HPP
+
+#include <algorithm> // std::min
+#include <chrono>
+
+class token_bucket {
+  using clock = std::chrono::steady_clock;
+
+  double rate = 0;
+  double burst = 0;
+  double tokens = 0;
+  clock::time_point last = clock::now();
+
+public:
+  // A bucket with a rate of 0 lets everything through
+  token_bucket() = default;
+
+  token_bucket(double rate, double burst) : rate(rate), burst(burst), tokens(burst) {}
+
+  // Whether the message may go through, taking a token if so
+  bool take() {
+    if (rate == 0) { return true; }
+    clock::time_point now = clock::now();
+    tokens = std::min(burst, tokens + rate * std::chrono::duration<double>(now - last).count());
+    last = now;
+    if (tokens < 1) { return false; }
+    tokens -= 1;
+    return true;
+  }
+};
+
+#endif // BOMBERMAN_TOKEN_BUCKET_HPP
@@ -0,0 +1,134 @@
+/* The optional UDP game channel (FEATURE_UDP). Once it is granted, the server
+ * sends the client a ServerMessageChannel with a token, and the client sends
+ * datagrams to the server's port, the same number as the TCP one:
+ *
+ *   client -> server: u32 token, u32 sequence, optionally a ClientMessage
+ *   server -> client: u32 epoch, u8 count, `count` ServerMessageTurns
+ *
+ * The first datagram of a client (one without a message) tells the server
+ * where to send the turns; from then on they come only over UDP. Every turn
+ * datagram repeats the turns before it, oldest first, so that a lost one
+ * is made up for by the next ones, and is tagged with the epoch, the number
+ * of the game, so that stray datagrams of a finished game are ignored. Inputs
+ * carry increasing sequence numbers; the server drops duplicates and the ones
+ * overtaken by a later input. Everything else stays on TCP, and so do gaps:
+ * the client asks for the turns it's missing with ClientMessageResendTurns.
+ */
+
+#ifndef BOMBERMAN_UDP_CHANNEL_HPP
+#define BOMBERMAN_UDP_CHANNEL_HPP
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <utility>
+
+#include "messages.hpp"
+
+// How many turns a turn datagram carries at most
+constexpr size_t udp_redundant_turns = 3;
+// How many times every input datagram is sent
+constexpr size_t udp_input_copies = 2;
+
+// Drops outgoing datagrams at random, to test the channel on loopback
+class loss_injector {
+  std::mutex mutex;
+  std::minstd_rand random;
+  std::bernoulli_distribution drop;
+
+public:
+  explicit loss_injector(double rate = 0) : random(std::random_device {}()), drop(rate) {}
+
+  void set_rate(double rate) {
+    std::scoped_lock lock {mutex};
+    drop = std::bernoulli_distribution(rate);
+  }
+
+  bool drop_next() {
+    std::scoped_lock lock {mutex};
+    return drop(random);
+  }
+};
+
+// Puts the turns of a game back in order, whichever channel they came over.
+// Turns which came over TCP are always in order and belong to the current
+// game, so they also tell that a game is on for a client which joined late.
+// Such a client learns the epoch of the game from its first datagram.
+class turn_sequencer {
+  uint32_t epoch = 0;
+  // whether a datagram of the current game came, which tells its epoch
+  bool epoch_known = false;
+  // whether the turns can be applied: the game is on
+  bool open = false;
+  turn_t next = 0;
+  std::map<turn_t, ServerMessageTurn> pending;
+  // the end of the last gap asked for, not to ask again until it's filled
+  std::optional<turn_t> requested;
+
+public:
+  void offer_datagram(uint32_t datagram_epoch, ServerMessageTurn&& turn) {
+    if (datagram_epoch < epoch) { return; }
+    if (datagram_epoch > epoch) {
+      if (open && next > 0) {
+        // the next game, while the end of this one is still on its way, or
+        // this one, if its turns came over TCP so far: those continue them
+        if (epoch_known || turn.turn < next) { return; }
+      } else {
+        pending.clear();
+      }
+      epoch = datagram_epoch;
+    }
+    epoch_known = true;
+    if (turn.turn < next) { return; }
+    pending.try_emplace(turn.turn, std::move(turn));
+  }
+
+  void offer_stream(ServerMessageTurn&& turn) {
+    open = true;
+    if (turn.turn < next) { return; }
+    pending.insert_or_assign(turn.turn, std::move(turn));
+  }
+
+  void start() {
+    open = true;
+    next = 0;
+    requested = std::nullopt;
+  }
+
+  // The datagrams from before that are stale
+  void end() {
+    open = false;
+    next = 0;
+    pending.clear();
+    requested = std::nullopt;
+    ++epoch;
+    epoch_known = false;
+  }
+
+  // The first turn not applied yet
+  turn_t next_turn() const { return next; }
+
+  // Calls f on every turn which is next in order
+  template <typename F>
+  void drain(F f) {
+    if (!open) { return; }
+    for (auto it = pending.begin(); it != pending.end() && it->first == next; it = pending.erase(it)) {
+      f(it->second);
+      ++next;
+    }
+  }
+
+  // The range of turns to ask for over TCP: those before the first pending
+  // one, once the datagrams which could still bring them are past it
+  std::optional<std::pair<turn_t, turn_t>> gap() {
+    if (pending.empty() || pending.begin()->first == next) { return std::nullopt; }
+    if (pending.rbegin()->first < next + udp_redundant_turns) { return std::nullopt; }
+    if (requested && next < *requested) { return std::nullopt; }
+    requested = pending.begin()->first;
+    return std::pair {next, *requested};
+  }
+};
+
+#endif // BOMBERMAN_UDP_CHANNEL_HPP
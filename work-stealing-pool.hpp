@@ -0,0 +1,141 @@
+/* Fixed set of worker threads running parallel loops. The indices of a loop
+ * are dealt out in contiguous chunks to one deque per worker (and one for the
+ * calling thread, which helps too); everybody pops from the back of their own
+ * deque and, once it is empty, steals from the front of the others, so uneven
+ * tasks still keep all the threads busy. A pool of 0 workers runs the loops
+ * inline on the calling thread.
+ */
+
+#ifndef BOMBERMAN_WORK_STEALING_POOL_HPP
+#define BOMBERMAN_WORK_STEALING_POOL_HPP
+
+#include <algorithm> // std::min
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+class work_stealing_pool {
+  struct task_queue {
+    std::mutex mutex;
+    std::deque<size_t> tasks;
+  };
+
+  // queues[i] for threads[i], the last one for the thread calling parallel_for
+  std::vector<std::unique_ptr<task_queue>> queues;
+  std::vector<std::thread> threads;
+
+  // the loop body; set before its tasks are queued
+  const std::function<void(size_t)>* job = nullptr;
+  std::atomic<size_t> remaining = 0;
+
+  std::mutex mutex_pool;
+  std::condition_variable cond_work;
+  std::condition_variable cond_done;
+  size_t generation = 0;
+  bool stopping = false;
+
+  std::optional<size_t> take(size_t self) {
+    {
+      task_queue& own = *queues[self];
+      std::scoped_lock lock {own.mutex};
+      if (!own.tasks.empty()) {
+        size_t task = own.tasks.back();
+        own.tasks.pop_back();
+        return task;
+      }
+    }
+    for (size_t k=1; k < queues.size(); ++k) {
+      task_queue& victim = *queues[(self + k) % queues.size()];
+      std::scoped_lock lock {victim.mutex};
+      if (!victim.tasks.empty()) {
+        size_t task = victim.tasks.front();
+        victim.tasks.pop_front();
+        return task;
+      }
+    }
+    return std::nullopt;
+  }
+
+  void run(size_t self) {
+    while (std::optional<size_t> task = take(self)) {
+      (*job)(*task);
+      if (remaining.fetch_sub(1) == 1) {
+        std::scoped_lock lock {mutex_pool};
+        cond_done.notify_all();
+      }
+    }
+  }
+
+  void work(size_t self) {
+    size_t seen = 0;
+    while (true) {
+      {
+        std::unique_lock lock {mutex_pool};
+        cond_work.wait(lock, [this, seen] { return stopping || generation != seen; });
+        if (stopping) { return; }
+        seen = generation;
+      }
+      run(self);
+    }
+  }
+
+public:
+  explicit work_stealing_pool(size_t workers) {
+    for (size_t i=0; i <= workers; ++i) {
+      queues.push_back(std::make_unique<task_queue>());
+    }
+    for (size_t i=0; i < workers; ++i) {
+      threads.emplace_back([this, i] { work(i); });
+    }
+  }
+
+  ~work_stealing_pool() {
+    {
+      std::scoped_lock lock {mutex_pool};
+      stopping = true;
+      cond_work.notify_all();
+    }
+    for (std::thread& thread : threads) { thread.join(); }
+  }
+
+  work_stealing_pool(const work_stealing_pool&) = delete;
+  work_stealing_pool& operator=(const work_stealing_pool&) = delete;
+
+  size_t workers() const { return threads.size(); }
+
+  // Calls f(i) for every i in [0, n), in no particular order, and returns
+  // once all of them are done. Not reentrant.
+  void parallel_for(size_t n, const std::function<void(size_t)>& f) {
+    if (threads.empty() || n < 2) {
+      for (size_t i=0; i < n; ++i) { f(i); }
+      return;
+    }
+
+    job = &f;
+    remaining = n;
+    size_t chunk = (n + queues.size() - 1) / queues.size();
+    for (size_t q=0; q < queues.size(); ++q) {
+      std::scoped_lock lock {queues[q]->mutex};
+      for (size_t i = q * chunk; i < std::min(n, (q + 1) * chunk); ++i) {
+        queues[q]->tasks.push_back(i);
+      }
+    }
+    {
+      std::scoped_lock lock {mutex_pool};
+      ++generation;
+      cond_work.notify_all();
+    }
+
+    run(queues.size() - 1);
+    std::unique_lock lock {mutex_pool};
+    cond_done.wait(lock, [this] { return remaining == 0; });
+  }
+};
+
+#endif // BOMBERMAN_WORK_STEALING_POOL_HPP